@@ -5,19 +5,243 @@
 #include <Rinternals.h>
 #include <stdlib.h> // for NULL
 #include <R_ext/Rdynload.h>
+#include <float.h> // for DBL_EPSILON
+#include <limits.h> // for INT_MAX
+#include <math.h>
 
-extern SEXP C_closest_dup_keep(SEXP, SEXP, SEXP, SEXP);
-extern SEXP C_closest_dup_closest(SEXP, SEXP, SEXP, SEXP);
-extern SEXP C_closest_dup_remove(SEXP, SEXP, SEXP, SEXP);
+/* error message for unsorted input or NA, %s: name of the table */
+#define UNSORTED_ERROR \
+    "'x' and '%s' have to be sorted non-decreasingly and must not contain NA."
+
+/**
+ * Tolerance for the i-th element of x.
+ *
+ * Combines the absolute tolerance (either of length 1 or of length(x)), the
+ * value-specific parts-per-million tolerance and a small epsilon to account
+ * for floating point inaccuracies. Computed on the fly to avoid the
+ * allocation of a tolerance vector of length(x).
+ *
+ * \param tolerance absolute tolerance.
+ * \param ntolerance length of tolerance, has to be 1 or length(x).
+ * \param i index of the current element.
+ * \param x value of the current element.
+ * \param ppm parts-per-million tolerance.
+ * \return tolerance for the i-th element.
+ */
+static inline double tolerance_at(const double *tolerance,
+                                  R_xlen_t ntolerance, R_xlen_t i,
+                                  double x, double ppm) {
+    return tolerance[ntolerance > 1 ? i : 0] + x * ppm * 1e-6 +
+        sqrt(DBL_EPSILON);
+}
+
+/**
+ * Test whether an array is sorted non-decreasingly and contains no NA/NaN.
+ *
+ * \param p array.
+ * \param n length of p.
+ * \return 1 if p is sorted and does not contain any NA, 0 otherwise.
+ */
+static inline int is_sorted(const double *p, R_xlen_t n) {
+    double prev = R_NegInf;
+
+    /* comparisons with NaN are always false */
+    for (R_xlen_t i = 0; i < n; ++i) {
+        if (!(p[i] >= prev))
+            return 0;
+        prev = p[i];
+    }
+    return 1;
+}
+
+/**
+ * Galloping (exponential) search.
+ *
+ * Find the first element in table[lo:hi] that is not smaller than value. The
+ * step size is doubled until such an element is found and the remaining
+ * interval is bisected afterwards. This is O(log(d)) where d is the distance
+ * between lo and the result instead of O(d) for a linear search.
+ *
+ * \param table table/haystack, has to be sorted increasingly.
+ * \param lo index to start the search.
+ * \param hi last index to look at.
+ * \param value value to look for.
+ * \return index of the first element >= value, hi if there is none or lo if
+ * lo >= hi.
+ */
+static inline R_xlen_t gallop(const double *table, R_xlen_t lo, R_xlen_t hi,
+                              double value) {
+    if (lo >= hi || !(table[lo] < value))
+        return lo;
+
+    /* table[lo] < value */
+    R_xlen_t step = 1, l = lo, h = lo + 1;
+
+    while (h < hi && table[h] < value) {
+        l = h;
+        step <<= 1;
+        h = lo + step;
+    }
+    if (h > hi)
+        h = hi;
+
+    /* table[l] < value <= table[h] (or h == hi) */
+    while (h - l > 1) {
+        R_xlen_t m = l + (h - l) / 2;
+        if (table[m] < value)
+            l = m;
+        else
+            h = m;
+    }
+    return h;
+}
+
+/**
+ * Output of (1-based) indices.
+ *
+ * Indices are stored as integer unless they could exceed INT_MAX (long
+ * vectors), double is used in this case. Exactly one of i and d is not NULL.
+ */
+typedef struct {
+    int *i;
+    double *d;
+} index_ptr;
+
+/**
+ * Allocate an index vector of length n for indices up to maxindex.
+ */
+static inline SEXP alloc_index(R_xlen_t n, R_xlen_t maxindex) {
+    return allocVector(maxindex > INT_MAX ? REALSXP : INTSXP, n);
+}
+
+static inline index_ptr index_ptr_of(SEXP x) {
+    index_ptr p = {NULL, NULL};
+    if (TYPEOF(x) == REALSXP)
+        p.d = REAL(x);
+    else
+        p.i = INTEGER(x);
+    return p;
+}
+
+static inline index_ptr index_offset(index_ptr p, R_xlen_t k) {
+    index_ptr o = {p.i ? p.i + k : NULL, p.d ? p.d + k : NULL};
+    return o;
+}
+
+/* value is an index or an integer nomatch value (could be NA_INTEGER) */
+static inline void index_set(index_ptr p, R_xlen_t k, R_xlen_t value) {
+    if (p.i)
+        p.i[k] = (int)value;
+    else
+        p.d[k] = value == NA_INTEGER ? NA_REAL : (double)value;
+}
+
+/* returns NA_INTEGER for NA */
+static inline R_xlen_t index_get(index_ptr p, R_xlen_t k) {
+    if (p.i)
+        return p.i[k];
+    return ISNAN(p.d[k]) ? NA_INTEGER : (R_xlen_t)p.d[k];
+}
+
+/* pre-indexed sorted table, see massIndex.c */
+typedef struct {
+    R_xlen_t n;         /* length of the table */
+    R_xlen_t nbuckets;  /* number of buckets */
+    R_xlen_t firstdup;  /* first i with table[i] == table[i + 1], or n */
+    double min;         /* smallest value in the table */
+    double width;       /* width of the buckets */
+    R_xlen_t *first;    /* first index of each bucket, length nbuckets + 1 */
+} mass_index;
+
+extern const mass_index* mass_index_resolve(SEXP*);
+extern R_xlen_t table_length(SEXP);
+extern R_xlen_t mass_index_lookup(const mass_index*, const double*, double);
+
+extern int radix_order(const double*, R_xlen_t, R_xlen_t*);
+extern SEXP sort_double(SEXP, R_xlen_t**);
+
+extern SEXP match_closest(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, int,
+                          const char*);
+extern SEXP C_closest_dup_keep(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP C_closest_dup_closest(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP C_closest_dup_remove(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP C_closest_list(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP C_closest_unsorted(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
 
 extern SEXP C_impNeighbourAvg(SEXP, SEXP);
 
-extern SEXP C_join_left(SEXP, SEXP, SEXP, SEXP);
-extern SEXP C_join_right(SEXP, SEXP, SEXP, SEXP);
-extern SEXP C_join_inner(SEXP, SEXP, SEXP, SEXP);
-extern SEXP C_join_outer(SEXP, SEXP, SEXP, SEXP);
+/* similarity of two aligned spectra, see distance.c */
+typedef double (*similarity_fun)(const double*, const double*, const double*,
+                                 const double*, R_xlen_t, double, double, int);
+extern double ndotproduct(const double*, const double*, const double*,
+                          const double*, R_xlen_t, double, double, int);
+extern double neuclidean(const double*, const double*, const double*,
+                         const double*, R_xlen_t, double, double, int);
+extern double navdist(const double*, const double*, const double*,
+                      const double*, R_xlen_t, double, double, int);
+extern double nspectraangle(const double*, const double*, const double*,
+                            const double*, R_xlen_t, double, double, int);
+extern SEXP C_ndotproduct(SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP C_neuclidean(SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP C_navdist(SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP C_nspectraangle(SEXP, SEXP, SEXP, SEXP, SEXP);
+/* peak matrices of spectra, see similarityMatrix.c */
+typedef struct {
+    SEXP protect;           /* list of the (coerced) matrices */
+    const double **peaks;   /* m/z values, followed by the intensities */
+    int *npeaks;            /* number of peaks (rows) */
+    int maxpeaks;           /* maximal number of peaks */
+} spectra;
+
+/* buffers of a single thread, length >= number of rows of an outer join */
+typedef struct {
+    int *rx, *ry;
+    double *xmz, *xint, *ymz, *yint;
+} pair_buffer;
+
+extern similarity_fun similarity_fun_of(SEXP);
+extern spectra prepare_spectra(SEXP, const char*);
+extern pair_buffer* alloc_pair_buffers(int, R_xlen_t);
+extern double pair_similarity(similarity_fun, const double*, int,
+                              const double*, int, const pair_buffer*,
+                              const double*, double, double, double, int);
+extern SEXP C_library_search(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP,
+                             SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP C_similarity_matrix(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP,
+                                SEXP);
+
+/* optional value columns of a join, all NULL if not requested */
+typedef struct {
+    double *x, *y, *delta, *ppm;
+} join_values;
+
+extern R_xlen_t join_outer(const double*, R_xlen_t, const double*, R_xlen_t,
+                           const double*, R_xlen_t, double, int, int, int,
+                           index_ptr, index_ptr, const join_values*);
+extern SEXP C_join_left(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP C_join_right(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP C_join_inner(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP C_join_outer(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP C_join_all(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP C_join_unsorted(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+
+extern SEXP C_localMaxima(SEXP, SEXP, SEXP);
+extern SEXP C_local_maxima_list(SEXP, SEXP, SEXP);
+
+extern SEXP C_mass_index(SEXP, SEXP);
+extern SEXP C_mass_index_table(SEXP);
+
+extern SEXP C_bin(SEXP, SEXP, SEXP, SEXP);
+extern SEXP C_bin_index(SEXP, SEXP);
+extern SEXP C_bin_list(SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP C_bin_ppm(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP C_bin_ppm_index(SEXP, SEXP, SEXP, SEXP);
+
+extern SEXP C_group(SEXP, SEXP, SEXP);
 
-extern SEXP C_localMaxima(SEXP, SEXP);
+extern SEXP C_coefSG(SEXP, SEXP);
+extern SEXP C_smooth(SEXP, SEXP);
+extern SEXP C_smooth_matrix(SEXP, SEXP, SEXP, SEXP);
 
 extern SEXP _MsCoreUtils_imp_neighbour_avg(SEXP, SEXP);
 
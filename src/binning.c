@@ -0,0 +1,707 @@
+#include "MsCoreUtils.h"
+
+#include <R.h>
+#include <Rinternals.h>
+#include <math.h>
+#include <stdlib.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/* reducers of C_bin, see .binFun */
+enum { BIN_MAX = 1, BIN_MIN, BIN_SUM, BIN_MEAN, BIN_LENGTH };
+
+/**
+ * Find the first break larger than value.
+ *
+ * Galloping search starting at lo, cheap for sorted values that fall into the
+ * same or a close bin as the previous one.
+ *
+ * \param breaks sorted breaks.
+ * \param lo, hi search range [lo, hi).
+ * \param value value to look for.
+ * \return index (0-based) of the first break > value or hi if there is none.
+ */
+static inline R_xlen_t upper_bound(const double *breaks, R_xlen_t lo,
+                                   R_xlen_t hi, double value) {
+    R_xlen_t step = 1, h = lo;
+
+    while (h < hi && breaks[h] <= value) {
+        lo = h + 1;
+        h = lo + step;
+        step <<= 1;
+    }
+    if (h > hi)
+        h = hi;
+
+    /* breaks[lo - 1] <= value < breaks[h] (or h == hi) */
+    while (lo < h) {
+        const R_xlen_t mid = lo + (h - lo) / 2;
+        if (breaks[mid] <= value)
+            lo = mid + 1;
+        else
+            h = mid;
+    }
+    return lo;
+}
+
+/**
+ * Find the bin of a value.
+ *
+ * Like findInterval(value, breaks) with the result clamped to
+ * 1:(nbreaks - 1), but 0-based.
+ *
+ * \param breaks sorted breaks.
+ * \param nbreaks number of breaks, >= 2.
+ * \param value value, must not be NA.
+ * \param prev bin of the previous value, the search starts here if value is
+ * not smaller than its lower break.
+ * \return bin index (0-based).
+ */
+static inline R_xlen_t bin_of(const double *breaks, R_xlen_t nbreaks,
+                              double value, R_xlen_t prev) {
+    const R_xlen_t i = breaks[prev] <= value ?
+        upper_bound(breaks, prev, nbreaks, value) :
+        upper_bound(breaks, 0, prev, value);
+
+    if (i < 1)
+        return 0;
+    if (i >= nbreaks)
+        return nbreaks - 2;
+    return i - 1;
+}
+
+/* relative deviation from the ideal grid that breaks may have to be treated as
+ * equally spaced, the bins are corrected by the real breaks anyway */
+#define UNIFORM_TOLERANCE 1e-6
+
+/* breaks and how to find the bin of a value */
+typedef struct {
+    const double *breaks;
+    R_xlen_t nbreaks;
+    R_xlen_t nuniform;  /* number of equally spaced breaks at the beginning */
+    double b0;          /* first break */
+    double size;        /* distance between the equally spaced breaks */
+    double lstep;       /* log distance of geometric breaks, 0 otherwise */
+} binner;
+
+/* are the first m breaks equally spaced? */
+static int is_uniform(const double *breaks, R_xlen_t m) {
+    const double size = (breaks[m - 1] - breaks[0]) / (m - 1);
+
+    if (!(size > 0))
+        return 0;
+    for (R_xlen_t i = 1; i < m - 1; ++i)
+        if (!(fabs(breaks[i] - (breaks[0] + i * size)) <=
+              UNIFORM_TOLERANCE * size))
+            return 0;
+    return 1;
+}
+
+/**
+ * Prepare the breaks for binner_bin.
+ *
+ * Equally spaced breaks (e.g. created by seq(by = size)) are detected, the
+ * last break could differ because .fix_breaks may append one.
+ *
+ * \param breaks sorted breaks.
+ * \param nbreaks number of breaks, >= 2.
+ */
+static binner binner_of(const double *breaks, R_xlen_t nbreaks) {
+    binner b = {breaks, nbreaks, 0, breaks[0], 0, 0};
+
+    if (nbreaks > 2 && is_uniform(breaks, nbreaks))
+        b.nuniform = nbreaks;
+    else if (nbreaks > 3 && is_uniform(breaks, nbreaks - 1))
+        b.nuniform = nbreaks - 1;
+
+    if (b.nuniform)
+        b.size = (breaks[b.nuniform - 1] - b.b0) / (b.nuniform - 1);
+    return b;
+}
+
+/**
+ * Geometric (ppm) bins.
+ *
+ * The breaks start * (1 + ppm * 1e-6)^k, k = 0, ..., nbins, are not
+ * created, the bin of a value is calculated as
+ * floor(log(value / start) / log1p(ppm * 1e-6)).
+ *
+ * \param start first break, > 0.
+ * \param ppm width of the bins in parts-per-million, > 0.
+ * \param nbins number of bins, >= 1.
+ */
+static binner binner_ppm(double start, double ppm, R_xlen_t nbins) {
+    binner b = {NULL, nbins + 1, 0, start, 0, log1p(ppm * 1e-6)};
+    return b;
+}
+
+/**
+ * Find the bin of a value.
+ *
+ * Like bin_of, but for geometric breaks (see binner_ppm) and equally spaced
+ * breaks the bin is calculated as
+ * floor((value - b0) / size) in O(1) and corrected by the real breaks to get
+ * exactly the same result as findInterval.
+ *
+ * \param b breaks, see binner_of.
+ * \param value value, must not be NA.
+ * \param prev bin of the previous value.
+ * \return bin index (0-based).
+ */
+static inline R_xlen_t binner_bin(const binner *b, double value,
+                                  R_xlen_t prev) {
+    const double *breaks = b->breaks;
+
+    if (b->lstep > 0) {
+        if (!(value > b->b0))
+            return 0;
+
+        const R_xlen_t last = b->nbreaks - 2;
+        double d = log(value / b->b0) / b->lstep;
+        return d < last ? (R_xlen_t)d : last;
+    }
+    if (b->nuniform && value < breaks[b->nuniform - 1]) {
+        if (value < b->b0)
+            return 0;
+
+        const R_xlen_t last = b->nuniform - 2;
+        double d = (value - b->b0) / b->size;
+        R_xlen_t j = d < last ? (R_xlen_t)d : last;
+
+        while (j > 0 && breaks[j] > value)
+            --j;
+        while (j < last && breaks[j + 1] <= value)
+            ++j;
+        return j;
+    }
+    if (b->nuniform)
+        prev = b->nuniform - 2;
+    return bin_of(breaks, b->nbreaks, value, prev);
+}
+
+/* like max/min, NA wins over NaN */
+static inline double bin_max(double a, double v) {
+    if (ISNAN(a) || ISNAN(v))
+        return R_IsNA(a) || R_IsNA(v) ? NA_REAL : R_NaN;
+    return v > a ? v : a;
+}
+
+static inline double bin_min(double a, double v) {
+    if (ISNAN(a) || ISNAN(v))
+        return R_IsNA(a) || R_IsNA(v) ? NA_REAL : R_NaN;
+    return v < a ? v : a;
+}
+
+/* final value of a sum or mean, a sum beyond the range of double is +/-Inf
+ * like for sum() (the conversion could round to +/-DBL_MAX) */
+static inline double bin_sum_value(int fun, long double s) {
+    if (fun == BIN_SUM) {
+        if (s > DBL_MAX)
+            return R_PosInf;
+        if (s < -DBL_MAX)
+            return R_NegInf;
+    }
+    return (double) s;
+}
+
+/**
+ * Add a value to a bin.
+ *
+ * \param fun reducer, see C_bin.
+ * \param acc aggregated values for max, min and length, 0 for empty bins.
+ * \param sum sums for sum and mean, accumulated in long double like sum()
+ * and mean() do, 0 for empty bins.
+ * \param count number of values per bin, not used for sum and length.
+ * \param k bin index (0-based).
+ * \param v value.
+ */
+static inline void bin_add(int fun, double *acc, long double *sum,
+                           R_xlen_t *count, R_xlen_t k, double v) {
+    switch (fun) {
+    case BIN_MAX:
+        acc[k] = count[k]++ ? bin_max(acc[k], v) : v;
+        break;
+    case BIN_MIN:
+        acc[k] = count[k]++ ? bin_min(acc[k], v) : v;
+        break;
+    case BIN_SUM:
+        sum[k] += v;
+        break;
+    case BIN_MEAN:
+        sum[k] += v;
+        ++count[k];
+        break;
+    case BIN_LENGTH:
+        ++acc[k];
+        break;
+    }
+}
+
+/**
+ * Another pass over the values for bin_mean.
+ *
+ * \param overflow if non-zero x / n is added to t for the bins whose sum
+ * overflowed, otherwise the residuals x - mean are added for the others.
+ */
+static void bin_mean_pass(const binner *b, const double *x, const double *y,
+                          R_xlen_t n, const long double *s, long double *t,
+                          const R_xlen_t *count, int overflow) {
+    R_xlen_t k = 0;
+
+    for (R_xlen_t i = 0; i < n; ++i) {
+        if (ISNAN(y[i]))
+            continue;
+        k = binner_bin(b, y[i], k);
+
+        const int finite = R_FINITE((double) s[k]);
+        if (overflow && !finite)
+            t[k] += x[i] / count[k];
+        else if (!overflow && finite)
+            t[k] += x[i] - s[k];
+    }
+}
+
+/**
+ * Turn the sums of the bins into means exactly like mean() does.
+ *
+ * The sums are divided by the number of values. If a sum overflows the
+ * values are divided before they are summed up instead. Afterwards the means
+ * are corrected by the mean of the residuals. This needs one or two more
+ * passes over x.
+ *
+ * \param b breaks, see binner_of and binner_ppm.
+ * \param x, y values to aggregate and values used for binning.
+ * \param n length of x and y.
+ * \param bins indices of the used bins, all bins if NULL.
+ * \param nbins length of bins or number of bins.
+ * \param s sums of the bins, replaced by the means.
+ * \param t buffer, has to be 0 for all bins and is 0 again afterwards.
+ * \param count number of values per bin.
+ */
+static void bin_mean(const binner *b, const double *x, const double *y,
+                     R_xlen_t n, const R_xlen_t *bins, R_xlen_t nbins,
+                     long double *s, long double *t, const R_xlen_t *count) {
+    int overflow = 0;
+    R_xlen_t k;
+
+    for (R_xlen_t j = 0; j < nbins; ++j) {
+        k = bins ? bins[j] : j;
+        if (!count[k])
+            continue;
+        if (R_FINITE((double) s[k]))
+            s[k] /= count[k];
+        else
+            overflow = 1;
+    }
+
+    if (overflow) {
+        bin_mean_pass(b, x, y, n, s, t, count, 1);
+        for (R_xlen_t j = 0; j < nbins; ++j) {
+            k = bins ? bins[j] : j;
+            if (count[k] && !R_FINITE((double) s[k])) {
+                s[k] = t[k];
+                t[k] = 0;
+            }
+        }
+    }
+
+    bin_mean_pass(b, x, y, n, s, t, count, 0);
+    for (R_xlen_t j = 0; j < nbins; ++j) {
+        k = bins ? bins[j] : j;
+        if (count[k] && R_FINITE((double) s[k]))
+            s[k] += t[k] / count[k];
+        t[k] = 0;
+    }
+}
+
+/**
+ * Aggregate values in bins.
+ *
+ * The values of x are accumulated in a single pass (mean needs more passes,
+ * see bin_mean), no vector per bin is created. Bins without values are 0.
+ *
+ * \param b breaks, see binner_of and binner_ppm.
+ * \param x double, values to aggregate.
+ * \param y double, values used for binning, same length as x; elements with
+ * NA are ignored.
+ * \param fun reducer, 1: max, 2: min, 3: sum, 4: mean, 5: length.
+ * \return aggregated values, one per bin.
+ */
+static SEXP bin_values(const binner *b, SEXP x, SEXP y, SEXP fun) {
+    const R_xlen_t n = XLENGTH(x), nbins = b->nbreaks - 1;
+    const int ifun = asInteger(fun);
+
+    if (XLENGTH(y) != n)
+        error("lengths of 'x' and 'y' have to match.");
+    if (ifun < BIN_MAX || ifun > BIN_LENGTH)
+        error("unknown reducer");
+
+    const double *px = REAL(x), *py = REAL(y);
+
+    SEXP out = PROTECT(allocVector(REALSXP, nbins));
+    double *pout = REAL(out);
+    memset(pout, 0, nbins * sizeof(double));
+
+    /* number of values per bin, max/min have to know about the first value */
+    R_xlen_t *count = NULL;
+    if (ifun != BIN_SUM && ifun != BIN_LENGTH) {
+        count = (R_xlen_t*) R_alloc(nbins, sizeof(R_xlen_t));
+        memset(count, 0, nbins * sizeof(R_xlen_t));
+    }
+
+    /* sums (and the buffer for bin_mean) */
+    long double *sum = NULL;
+    if (ifun == BIN_SUM || ifun == BIN_MEAN) {
+        sum = (long double*) R_alloc(2 * nbins, sizeof(long double));
+        for (R_xlen_t j = 0; j < 2 * nbins; ++j)
+            sum[j] = 0;
+    }
+
+    R_xlen_t k = 0;
+    for (R_xlen_t i = 0; i < n; ++i) {
+        if (ISNAN(py[i]))
+            continue;
+        k = binner_bin(b, py[i], k);
+        bin_add(ifun, pout, sum, count, k, px[i]);
+    }
+
+    if (sum) {
+        if (ifun == BIN_MEAN)
+            bin_mean(b, px, py, n, NULL, nbins, sum, sum + nbins, count);
+        for (R_xlen_t j = 0; j < nbins; ++j)
+            pout[j] = bin_sum_value(ifun, sum[j]);
+    }
+
+    UNPROTECT(1);
+    return out;
+}
+
+/**
+ * Find the bins of values.
+ *
+ * \param b breaks, see binner_of and binner_ppm.
+ * \param y double, values.
+ * \return 1-based bin indices, NA for NA in y.
+ */
+static SEXP bin_index(const binner *b, SEXP y) {
+    const R_xlen_t n = XLENGTH(y);
+    const double *py = REAL(y);
+
+    SEXP out = PROTECT(alloc_index(n, b->nbreaks));
+    index_ptr pout = index_ptr_of(out);
+
+    R_xlen_t k = 0;
+    for (R_xlen_t i = 0; i < n; ++i) {
+        if (ISNAN(py[i]))
+            index_set(pout, i, NA_INTEGER);
+        else {
+            k = binner_bin(b, py[i], k);
+            index_set(pout, i, k + 1);
+        }
+    }
+
+    UNPROTECT(1);
+    return out;
+}
+
+/**
+ * Aggregate values in bins.
+ *
+ * The bins of equally spaced breaks are calculated arithmetically (see
+ * binner_bin).
+ *
+ * \param x double, values to aggregate.
+ * \param y double, values used for binning, same length as x; elements with
+ * NA are ignored.
+ * \param breaks double, sorted breaks, length >= 2.
+ * \param fun reducer, 1: max, 2: min, 3: sum, 4: mean, 5: length.
+ * \return aggregated values, length(breaks) - 1.
+ */
+SEXP C_bin(SEXP x, SEXP y, SEXP breaks, SEXP fun) {
+    const R_xlen_t nbreaks = XLENGTH(breaks);
+
+    if (nbreaks < 2)
+        error("'breaks' has to contain at least two elements.");
+
+    const binner b = binner_of(REAL(breaks), nbreaks);
+    return bin_values(&b, x, y, fun);
+}
+
+/**
+ * Find the bins of values.
+ *
+ * Like findInterval(y, breaks) with the result clamped to
+ * 1:(length(breaks) - 1), see binner_bin.
+ *
+ * \param y double, values.
+ * \param breaks double, sorted breaks, length >= 2.
+ * \return 1-based bin indices, NA for NA in y.
+ */
+SEXP C_bin_index(SEXP y, SEXP breaks) {
+    const R_xlen_t nbreaks = XLENGTH(breaks);
+
+    if (nbreaks < 2)
+        error("'breaks' has to contain at least two elements.");
+
+    const binner b = binner_of(REAL(breaks), nbreaks);
+    return bin_index(&b, y);
+}
+
+/* geometric bins of C_bin_ppm and C_bin_ppm_index */
+static binner binner_ppm_of(SEXP start, SEXP ppm, SEXP nbins) {
+    const double dstart = asReal(start), dppm = asReal(ppm);
+    const double dnbins = asReal(nbins);
+
+    if (!R_FINITE(dstart) || !(dstart > 0))
+        error("the first break has to be finite and larger than zero.");
+    if (!R_FINITE(dppm) || !(dppm > 0))
+        error("'ppm' has to be finite and larger than zero.");
+    /* test before the cast, NaN/Inf can't be converted to an integer */
+    if (!R_FINITE(dnbins) || dnbins < 1 || dnbins > R_XLEN_T_MAX)
+        error("'nbins' has to be a finite number larger than zero.");
+    return binner_ppm(dstart, dppm, (R_xlen_t) dnbins);
+}
+
+/**
+ * Aggregate values in geometric (ppm) bins.
+ *
+ * Like C_bin for the breaks start * (1 + ppm * 1e-6)^(0:nbins), see
+ * binner_ppm, without creating the breaks.
+ *
+ * \param x double, values to aggregate.
+ * \param y double, values used for binning, same length as x; elements with
+ * NA are ignored.
+ * \param start first break, > 0.
+ * \param ppm width of the bins in parts-per-million, > 0.
+ * \param nbins number of bins, >= 1.
+ * \param fun reducer, 1: max, 2: min, 3: sum, 4: mean, 5: length.
+ * \return aggregated values, length nbins.
+ */
+SEXP C_bin_ppm(SEXP x, SEXP y, SEXP start, SEXP ppm, SEXP nbins, SEXP fun) {
+    const binner b = binner_ppm_of(start, ppm, nbins);
+    return bin_values(&b, x, y, fun);
+}
+
+/**
+ * Find the geometric (ppm) bins of values.
+ *
+ * Like C_bin_index for the breaks start * (1 + ppm * 1e-6)^(0:nbins).
+ *
+ * \param y double, values.
+ * \param start first break, > 0.
+ * \param ppm width of the bins in parts-per-million, > 0.
+ * \param nbins number of bins, >= 1.
+ * \return 1-based bin indices, NA for NA in y.
+ */
+SEXP C_bin_ppm_index(SEXP y, SEXP start, SEXP ppm, SEXP nbins) {
+    const binner b = binner_ppm_of(start, ppm, nbins);
+    return bin_index(&b, y);
+}
+
+/* per thread buffers of C_bin_list */
+typedef struct {
+    double *acc;        /* aggregated values, length nbins */
+    long double *sum;   /* sums and the buffer of bin_mean, length 2 * nbins,
+                           just for sum and mean */
+    R_xlen_t *count;    /* number of values per bin, length nbins */
+    R_xlen_t *mark;     /* last spectrum that used a bin, length nbins */
+    R_xlen_t *bins;     /* bins used by the current spectrum */
+} bin_buffer;
+
+static int cmp_xlen(const void *a, const void *b) {
+    const R_xlen_t x = *(const R_xlen_t*)a, y = *(const R_xlen_t*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Aggregate the values of a spectrum in bins.
+ *
+ * Doesn't use the R API and could be called from multiple threads.
+ *
+ * \param b breaks, see binner_of.
+ * \param fun reducer, see C_bin.
+ * \param x, y values to aggregate and values used for binning.
+ * \param n length of x and y.
+ * \param id unique id of the spectrum (and pass), != 0, to mark the bins.
+ * \param buf buffers, acc, sum and count have to be 0 for all bins and are 0
+ * again after a call with val != NULL. The used bins are in buf->bins.
+ * \param val if not NULL the bins are sorted increasingly and the aggregated
+ * values are written to val, otherwise the bins are just counted.
+ * \return number of used bins.
+ */
+static R_xlen_t bin_spectrum(const binner *b, int fun, const double *x,
+                             const double *y, R_xlen_t n, R_xlen_t id,
+                             bin_buffer *buf, double *val) {
+    R_xlen_t nused = 0, k = 0;
+    int sorted = 1;
+
+    for (R_xlen_t i = 0; i < n; ++i) {
+        if (ISNAN(y[i]))
+            continue;
+        k = binner_bin(b, y[i], k);
+
+        if (buf->mark[k] != id) {
+            buf->mark[k] = id;
+            if (nused && buf->bins[nused - 1] > k)
+                sorted = 0;
+            buf->bins[nused++] = k;
+        }
+        if (val)
+            bin_add(fun, buf->acc, buf->sum, buf->count, k, x[i]);
+    }
+
+    if (val) {
+        if (!sorted)
+            qsort(buf->bins, nused, sizeof(R_xlen_t), cmp_xlen);
+        if (fun == BIN_MEAN)
+            bin_mean(b, x, y, n, buf->bins, nused, buf->sum,
+                     buf->sum + b->nbreaks - 1, buf->count);
+
+        for (R_xlen_t j = 0; j < nused; ++j) {
+            k = buf->bins[j];
+            if (buf->sum) {
+                val[j] = bin_sum_value(fun, buf->sum[k]);
+                buf->sum[k] = 0;
+            } else
+                val[j] = buf->acc[k];
+            buf->acc[k] = 0;
+            buf->count[k] = 0;
+        }
+    }
+    return nused;
+}
+
+/**
+ * Aggregate values of multiple spectra in shared bins.
+ *
+ * The result is a sparse matrix (spectra x bins) in triplet form, ordered by
+ * spectrum and bin (like a CSR matrix), that contains just the bins with at
+ * least one value. The spectra are processed in parallel in two passes: the
+ * first counts the used bins of each spectrum, the second writes the
+ * aggregated values directly into the result. A dense matrix is never
+ * created.
+ *
+ * \param x list of double, values to aggregate.
+ * \param y list of double, values used for binning, same lengths as x;
+ * elements with NA are ignored.
+ * \param breaks double, sorted breaks, length >= 2.
+ * \param fun reducer, 1: max, 2: min, 3: sum, 4: mean, 5: length.
+ * \param nthreads number of threads to use.
+ * \return list with the spectrum index i, the bin index j (both 1-based)
+ * and the aggregated value x.
+ */
+SEXP C_bin_list(SEXP x, SEXP y, SEXP breaks, SEXP fun, SEXP nthreads) {
+    const R_xlen_t ns = XLENGTH(x), nbreaks = XLENGTH(breaks);
+    const int ifun = asInteger(fun);
+
+    if (TYPEOF(x) != VECSXP || TYPEOF(y) != VECSXP || XLENGTH(y) != ns)
+        error("'x' and 'y' have to be lists of the same length.");
+    if (nbreaks < 2)
+        error("'breaks' has to contain at least two elements.");
+    if (ifun < BIN_MAX || ifun > BIN_LENGTH)
+        error("unknown reducer");
+
+    const double **px = (const double**) R_alloc(ns, sizeof(double*));
+    const double **py = (const double**) R_alloc(ns, sizeof(double*));
+    R_xlen_t *n = (R_xlen_t*) R_alloc(ns, sizeof(R_xlen_t));
+    R_xlen_t *offset = (R_xlen_t*) R_alloc(ns + 1, sizeof(R_xlen_t));
+    R_xlen_t maxn = 0;
+
+    for (R_xlen_t i = 0; i < ns; ++i) {
+        SEXP xi = VECTOR_ELT(x, i), yi = VECTOR_ELT(y, i);
+        if (TYPEOF(xi) != REALSXP || TYPEOF(yi) != REALSXP)
+            error("all elements of 'x' and 'y' have to be of type 'double'");
+        if (XLENGTH(xi) != XLENGTH(yi))
+            error("lengths of the elements of 'x' and 'y' have to match.");
+        px[i] = REAL(xi);
+        py[i] = REAL(yi);
+        n[i] = XLENGTH(xi);
+        if (n[i] > maxn)
+            maxn = n[i];
+    }
+
+    const binner b = binner_of(REAL(breaks), nbreaks);
+    const R_xlen_t nbins = nbreaks - 1;
+
+    int nth = asInteger(nthreads);
+#ifdef _OPENMP
+    if (nth < 1 || ns < 2)
+        nth = 1;
+#else
+    nth = 1;
+#endif
+
+    bin_buffer *buf = (bin_buffer*) R_alloc(nth, sizeof(bin_buffer));
+    for (int t = 0; t < nth; ++t) {
+        buf[t].acc = (double*) R_alloc(nbins, sizeof(double));
+        buf[t].count = (R_xlen_t*) R_alloc(3 * nbins + maxn,
+                                           sizeof(R_xlen_t));
+        buf[t].mark = buf[t].count + nbins;
+        buf[t].bins = buf[t].mark + nbins;
+        memset(buf[t].acc, 0, nbins * sizeof(double));
+        memset(buf[t].count, 0, 2 * nbins * sizeof(R_xlen_t));
+        buf[t].sum = NULL;
+        if (ifun == BIN_SUM || ifun == BIN_MEAN) {
+            buf[t].sum = (long double*) R_alloc(2 * nbins,
+                                                sizeof(long double));
+            for (R_xlen_t j = 0; j < 2 * nbins; ++j)
+                buf[t].sum[j] = 0;
+        }
+    }
+
+    /* first pass, ids i + 1 */
+#ifdef _OPENMP
+    #pragma omp parallel for num_threads(nth) schedule(dynamic)
+#endif
+    for (R_xlen_t i = 0; i < ns; ++i) {
+        int t = 0;
+#ifdef _OPENMP
+        t = omp_get_thread_num();
+#endif
+        offset[i + 1] = bin_spectrum(&b, ifun, px[i], py[i], n[i], i + 1,
+                                     &buf[t], NULL);
+    }
+
+    offset[0] = 0;
+    for (R_xlen_t i = 0; i < ns; ++i)
+        offset[i + 1] += offset[i];
+    const R_xlen_t total = offset[ns];
+
+    SEXP ri = PROTECT(alloc_index(total, ns));
+    SEXP rj = PROTECT(alloc_index(total, nbins));
+    SEXP rx = PROTECT(allocVector(REALSXP, total));
+    index_ptr pri = index_ptr_of(ri), prj = index_ptr_of(rj);
+    double *prx = REAL(rx);
+
+    /* second pass, ids -(i + 1) */
+#ifdef _OPENMP
+    #pragma omp parallel for num_threads(nth) schedule(dynamic)
+#endif
+    for (R_xlen_t i = 0; i < ns; ++i) {
+        int t = 0;
+#ifdef _OPENMP
+        t = omp_get_thread_num();
+#endif
+        bin_spectrum(&b, ifun, px[i], py[i], n[i], -(i + 1), &buf[t],
+                     prx + offset[i]);
+        for (R_xlen_t o = offset[i]; o < offset[i + 1]; ++o) {
+            index_set(pri, o, i + 1);
+            index_set(prj, o, buf[t].bins[o - offset[i]] + 1);
+        }
+    }
+
+    SEXP out = PROTECT(allocVector(VECSXP, 3));
+    SEXP nms = PROTECT(allocVector(STRSXP, 3));
+    SET_VECTOR_ELT(out, 0, ri);
+    SET_VECTOR_ELT(out, 1, rj);
+    SET_VECTOR_ELT(out, 2, rx);
+    SET_STRING_ELT(nms, 0, mkChar("i"));
+    SET_STRING_ELT(nms, 1, mkChar("j"));
+    SET_STRING_ELT(nms, 2, mkChar("x"));
+    setAttrib(out, R_NamesSymbol, nms);
+
+    UNPROTECT(5);
+    return out;
+}
@@ -7,88 +7,169 @@
 #include <Rinternals.h>
 #include <math.h>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 /**
  * Find closest value to table, keep duplicates.
  *
- * \param x key value to look for.
- * \param table table/haystack where to look for.
- * \param tolerance allowed tolerance to be accepted as match, has to be of
- * length == length(x).
+ * \param px key values to look for.
+ * \param nx length of px.
+ * \param ptable table/haystack where to look for.
+ * \param ntable length of ptable.
+ * \param ptolerance allowed absolute tolerance, of length 1 or nx.
+ * \param ntolerance length of ptolerance.
+ * \param ppm parts-per-million tolerance (added to tolerance).
  * \param nomatch value that should be returned if a key couldn't be matched.
- * \return index the closest element
- *
- * \note x and table have to be sorted increasingly and not containing any NA.
+ * \param from index in table to start the search.
+ * \param check if non-zero, test whether px is sorted and contains no NA
+ * while matching.
+ * \param pout output, index (1-based) of the closest element or nomatch.
+ * \param last if not NULL, the position in table after the last key is
+ * stored here.
+ * \return 1 if the check failed (pout is incomplete in this case), 0
+ * otherwise.
  */
-SEXP C_closest_dup_keep(SEXP x, SEXP table, SEXP tolerance, SEXP nomatch) {
-    double *px = REAL(x);
-    const unsigned int nx = LENGTH(x);
+static int closest_dup_keep(const double *px, R_xlen_t nx,
+                            const double *ptable, R_xlen_t ntable,
+                            const double *ptolerance, R_xlen_t ntolerance,
+                            double ppm, int nomatch, R_xlen_t from,
+                            int check, index_ptr pout, R_xlen_t *last) {
+    const R_xlen_t ntable1 = ntable - 1;
+    R_xlen_t j = from > 1 ? from : 1;
 
-    double *ptable = REAL(table);
-    const unsigned int ntable1 = LENGTH(table) - 1;
+    double prevdiff = R_PosInf, nextdiff = R_PosInf, tol = 0;
+    double prevx = R_NegInf;
 
-    double *ptolerance = REAL(tolerance);
-
-    SEXP out = PROTECT(allocVector(INTSXP, nx));
-    int* pout = INTEGER(out);
-
-    const unsigned int inomatch = asInteger(nomatch);
-    unsigned int j = 1;
-
-    double prevdiff = R_PosInf, nextdiff = R_PosInf;
-
-    for (unsigned int i = 0; i < nx; ++i) {
-        while(j < ntable1 && ptable[j] < px[i])
-            ++j;
+    for (R_xlen_t i = 0; i < nx; ++i) {
+        if (check) {
+            if (!(px[i] >= prevx))
+                return 1;
+            prevx = px[i];
+        }
+        j = gallop(ptable, j, ntable1, px[i]);
 
         /* fabs should be just needed for the first element */
         prevdiff = fabs(px[i] - ptable[j - 1]);
-        nextdiff = fabs(ptable[j] - px[i]);
+        nextdiff = j < ntable ? fabs(ptable[j] - px[i]) : R_PosInf;
+
+        tol = tolerance_at(ptolerance, ntolerance, i, px[i], ppm);
 
-        if (prevdiff <= ptolerance[i] || nextdiff <= ptolerance[i]) {
+        if (prevdiff <= tol || nextdiff <= tol) {
             if (prevdiff <= nextdiff)
-                pout[i] = j;
+                index_set(pout, i, j);
             else
-                pout[i] = ++j;
+                index_set(pout, i, ++j);
         } else
-            pout[i] = inomatch;
+            index_set(pout, i, nomatch);
     }
+    if (last)
+        *last = j;
+    return 0;
+}
 
-    UNPROTECT(1);
-    return out;
+/* state of the closest_dup_closest algorithm, -1: no match yet */
+typedef struct {
+    R_xlen_t ix, itbl, ixlastused, itbllastused;
+} closest_state;
+
+/* distance between the states stored for the parallel closest_dup_closest */
+#define CHECKPOINT_DIST 64
+
+/**
+ * Test whether two states of closest_dup_closest would produce the same
+ * results from here on. The last used indices are irrelevant if they can't be
+ * revisited (itbl is never decremented).
+ */
+static inline int same_state(const closest_state *a, const closest_state *b) {
+    return a->ix == b->ix && a->itbl == b->itbl &&
+        a->itbllastused < a->itbl && b->itbllastused < b->itbl;
 }
 
 /**
- * Find closest value to table, keep just closest duplicates.
+ * Start position in an indexed table for closest_dup_closest.
  *
- * \param x key value to look for.
- * \param table table/haystack where to look for.
- * \param tolerance allowed tolerance to be accepted as match, has to be of
- * length == length(x).
- * \param nomatch value that should be returned if a key couldn't be matched.
- * \return index the closest element
+ * Starting at the first table element closest_dup_closest skips all
+ * elements up to the closest one to x[0] (the lower one for ties) but stops
+ * at the first duplicated table value. Starting at this position gives
+ * identical results.
  *
- * \note x and table have to be sorted increasingly and not containing any NA.
- * \author Sebastian Gibb and Johannes Rainer
+ * \param idx index.
+ * \param ptable indexed table.
+ * \param x first key value.
+ * \return index (0-based) in table to start with.
  */
-SEXP C_closest_dup_closest(SEXP x, SEXP table, SEXP tolerance, SEXP nomatch) {
-    double *px = REAL(x);
-    const unsigned int nx = LENGTH(x);
-
-    double *ptable = REAL(table);
-    const unsigned int ntable = LENGTH(table);
-
-    double *ptolerance = REAL(tolerance);
-
-    SEXP out = PROTECT(allocVector(INTSXP, nx));
-    int* pout = INTEGER(out);
+static R_xlen_t closest_start(const mass_index *idx, const double *ptable,
+                              double x) {
+    R_xlen_t k = mass_index_lookup(idx, ptable, x), s = k;
 
-    const unsigned int inomatch = asInteger(nomatch);
+    if (k && (k == idx->n || !(ptable[k] - x < x - ptable[k - 1])))
+        s = k - 1;
+    return s < idx->firstdup ? s : idx->firstdup;
+}
 
-    unsigned int ix = 0, ixlastused = 1;
-    unsigned int itbl = 0, itbllastused = 1;
+/**
+ * Find closest value to table, keep just closest duplicates.
+ *
+ * Run the algorithm from state s until s->ix == end. The state at every
+ * CHECKPOINT_DIST-th x is stored in record (if not NULL) or compared to
+ * compare (if not NULL). In the latter case the function returns as soon as
+ * the states are identical because the results from that point on are
+ * identical too.
+ *
+ * \param px key values to look for.
+ * \param nx length of px.
+ * \param ptable table/haystack where to look for.
+ * \param ntable length of ptable.
+ * \param ptolerance allowed absolute tolerance, of length 1 or nx.
+ * \param ntolerance length of ptolerance.
+ * \param ppm parts-per-million tolerance (added to tolerance).
+ * \param nomatch value that should be returned if a key couldn't be matched.
+ * \param pout output, index (1-based) of the closest element or nomatch.
+ * \param s current state.
+ * \param end index in x where to stop.
+ * \param record states to record (indexed by ix / CHECKPOINT_DIST).
+ * \param compare states to compare with (indexed by ix / CHECKPOINT_DIST).
+ * \param check if non-zero, test whether px is sorted and contains no NA
+ * while matching.
+ * \return 1 if a state identical to compare was found, -1 if the check
+ * failed, 0 otherwise.
+ * \author Sebastian Gibb and Johannes Rainer
+ */
+static int closest_dup_closest(const double *px, R_xlen_t nx,
+                               const double *ptable, R_xlen_t ntable,
+                               const double *ptolerance, R_xlen_t ntolerance,
+                               double ppm, int nomatch, index_ptr pout,
+                               closest_state *s, R_xlen_t end,
+                               closest_state *record,
+                               const closest_state *compare, int check) {
+    R_xlen_t ix = s->ix, ixlastused = s->ixlastused, ixchecked = -1;
+    R_xlen_t itbl = s->itbl, itbllastused = s->itbllastused;
+    R_xlen_t nextcp = (ix + CHECKPOINT_DIST - 1) / CHECKPOINT_DIST *
+        CHECKPOINT_DIST;
     double diff = R_PosInf, diffnxtx = R_PosInf, diffnxttbl = R_PosInf;
+    double tol = 0;
+    int converged = 0;
 
-    while (ix < nx) {
+    while (ix < end) {
+        if (check && ix != ixchecked) {
+            if (!(px[ix] >= (ix ? px[ix - 1] : R_NegInf))) {
+                converged = -1;
+                break;
+            }
+            ixchecked = ix;
+        }
+        if ((record || compare) && ix == nextcp) {
+            closest_state cur = {ix, itbl, ixlastused, itbllastused};
+            if (record)
+                record[ix / CHECKPOINT_DIST] = cur;
+            if (compare && same_state(&cur, &compare[ix / CHECKPOINT_DIST])) {
+                converged = 1;
+                break;
+            }
+            nextcp += CHECKPOINT_DIST;
+        }
         if (itbl < ntable) {
             /* difference for current pair */
             diff = fabs(px[ix] - ptable[itbl]);
@@ -98,16 +179,18 @@ SEXP C_closest_dup_closest(SEXP x, SEXP table, SEXP tolerance, SEXP nomatch) {
             diffnxttbl =
                 itbl + 1 < ntable ? fabs(px[ix] - ptable[itbl + 1]) : R_PosInf;
 
-            if (diff <= ptolerance[ix]) {
+            tol = tolerance_at(ptolerance, ntolerance, ix, px[ix], ppm);
+
+            if (diff <= tol) {
                 /* valid match, add + 1 to convert between R/C index */
-                pout[ix] = itbl + 1;
+                index_set(pout, ix, itbl + 1);
                 if (itbl == itbllastused &&
                         (diffnxtx < diffnxttbl || diff < diffnxttbl))
-                    pout[ixlastused] = inomatch;
+                    index_set(pout, ixlastused, nomatch);
                 ixlastused = ix;
                 itbllastused = itbl;
             } else
-                pout[ix] = inomatch;
+                index_set(pout, ix, nomatch);
 
             if (diffnxtx < diff || diffnxttbl < diff) {
                 /* increment the index with the smaller distance */
@@ -121,72 +204,601 @@ SEXP C_closest_dup_closest(SEXP x, SEXP table, SEXP tolerance, SEXP nomatch) {
                 ++itbl;
             }
         } else
-            pout[ix++] = inomatch;
+            index_set(pout, ix++, nomatch);
     }
 
+    s->ix = ix;
+    s->itbl = itbl;
+    s->ixlastused = ixlastused;
+    s->itbllastused = itbllastused;
+    return converged;
+}
+
+/**
+ * Match a single key for closest_dup_remove.
+ *
+ * The only state carried from one key to the next is the position in table
+ * (j and lastj are identical when the function returns).
+ *
+ * \param x key value.
+ * \param ptable table/haystack where to look for.
+ * \param ntable length of ptable.
+ * \param tol tolerance for x.
+ * \param j position in table (1-based index of the first element that could
+ * be larger than x), updated.
+ * \param lastj position after the previous key, updated.
+ * \return index (1-based) of the closest element, 0 if there is none within
+ * the tolerance or -1 if x and the previous key match the same element (both
+ * are removed).
+ */
+static inline R_xlen_t closest_remove_step(double x, const double *ptable,
+                                           R_xlen_t ntable, double tol,
+                                           R_xlen_t *j, R_xlen_t *lastj) {
+    R_xlen_t k = gallop(ptable, *j, ntable - 1, x), m = 0;
+
+    /* fabs should be just needed for the first element */
+    double prevdiff = fabs(x - ptable[k - 1]);
+    double nextdiff = k < ntable ? fabs(ptable[k] - x) : R_PosInf;
+
+    if (prevdiff <= tol || nextdiff <= tol) {
+        if (prevdiff <= nextdiff)
+            /* match on the left */
+            m = *lastj == k ? -1 : k;
+        else
+            /* match on the right */
+            m = *lastj == k + 1 ? -1 : ++k;
+    }
+    *j = *lastj = k;
+    return m;
+}
+
+/* store the result of closest_remove_step for the i-th key */
+static inline void closest_remove_set(index_ptr pout, R_xlen_t i, R_xlen_t m,
+                                      int nomatch) {
+    if (m < 0) {
+        index_set(pout, i, nomatch);
+        index_set(pout, i - 1, nomatch);
+    } else
+        index_set(pout, i, m ? m : nomatch);
+}
+
+/**
+ * Find closest value to table, remove duplicates.
+ *
+ * See closest_dup_keep for the parameters.
+ */
+static int closest_dup_remove(const double *px, R_xlen_t nx,
+                              const double *ptable, R_xlen_t ntable,
+                              const double *ptolerance, R_xlen_t ntolerance,
+                              double ppm, int nomatch, R_xlen_t from,
+                              int check, index_ptr pout, R_xlen_t *last) {
+    R_xlen_t j = from > 1 ? from : 1, lastj = 0;
+    double tol = 0, prevx = R_NegInf;
+
+    for (R_xlen_t i = 0; i < nx; ++i) {
+        if (check) {
+            if (!(px[i] >= prevx))
+                return 1;
+            prevx = px[i];
+        }
+        tol = tolerance_at(ptolerance, ntolerance, i, px[i], ppm);
+        closest_remove_set(pout, i,
+                           closest_remove_step(px[i], ptable, ntable, tol,
+                                               &j, &lastj),
+                           nomatch);
+    }
+    if (last)
+        *last = j;
+    return 0;
+}
+
+typedef int (*closest_fun)(const double*, R_xlen_t, const double*, R_xlen_t,
+                           const double*, R_xlen_t, double, int, R_xlen_t,
+                           int, index_ptr, R_xlen_t*);
+
+/* minimal number of elements per thread */
+#define MIN_CHUNK_SIZE 4096
+
+/**
+ * Number of chunks x is split into.
+ *
+ * \param n length of x.
+ * \param nthreads number of threads requested.
+ */
+static int nchunks(R_xlen_t n, int nthreads) {
+#ifdef _OPENMP
+    R_xlen_t nc = n / MIN_CHUNK_SIZE;
+    if (nc > nthreads)
+        nc = nthreads;
+    return nc > 1 ? (int)nc : 1;
+#else
+    return 1;
+#endif
+}
+
+/**
+ * Index (0-based) of the element in table right before x, used as start
+ * position for the chunks. If table is indexed the bucket lookup is used
+ * instead of a galloping search over the whole table.
+ */
+static R_xlen_t chunk_start(const mass_index *idx, const double *ptable,
+                            R_xlen_t ntable, double x) {
+    R_xlen_t from = idx ? mass_index_lookup(idx, ptable, x) :
+        gallop(ptable, 0, ntable - 1, x);
+    return from ? from - 1 : 0;
+}
+
+/**
+ * Apply closest_dup_keep or closest_dup_remove.
+ *
+ * If nthreads > 1 (and OpenMP is available) x is split into chunks that are
+ * matched against table in parallel. Because x and table are sorted the start
+ * position in table for each chunk is found by a galloping search.
+ * table could be a mass index (see massIndex.c), the search for the start
+ * positions is replaced by a bucket lookup in this case.
+ *
+ * If check is TRUE x (while matching) and table (before matching, unless it
+ * is a mass index) are tested for being sorted and not containing NA. tname
+ * is the name of table used in the error message.
+ *
+ * If table is empty nomatch is returned for all elements of x.
+ *
+ * If last is not NULL the position in table after the last key of each chunk
+ * is stored in last (has to be of length nchunks(length(x), nthreads)).
+ *
+ * \return number of chunks used.
+ */
+static int closest_chunked(closest_fun fun, SEXP x, SEXP table,
+                           SEXP tolerance, SEXP ppm, SEXP nomatch,
+                           SEXP nthreads, SEXP check, const char *tname,
+                           SEXP out, R_xlen_t *last) {
+    double *px = REAL(x);
+    const R_xlen_t nx = XLENGTH(x);
+
+    const mass_index *idx = mass_index_resolve(&table);
+    double *ptable = REAL(table);
+    const R_xlen_t ntable = XLENGTH(table);
+
+    double *ptolerance = REAL(tolerance);
+    const R_xlen_t ntolerance = XLENGTH(tolerance);
+    const double dppm = asReal(ppm);
+
+    if (ntolerance != 1 && ntolerance != nx)
+        error("'tolerance' has to be of length 1 or equal to 'length(x)'");
+
+    const int icheck = asLogical(check);
+    if (icheck && !idx && !is_sorted(ptable, ntable))
+        error(UNSORTED_ERROR, tname);
+
+    index_ptr pout = index_ptr_of(out);
+    const int inomatch = asInteger(nomatch);
+
+    /* the kernels need at least one table element */
+    if (!ntable) {
+        for (R_xlen_t i = 0; i < nx; ++i)
+            index_set(pout, i, inomatch);
+        return 1;
+    }
+
+    const int nc = nchunks(nx, asInteger(nthreads));
+    int unsorted = 0;
+
+    if (nc == 1) {
+        unsorted = fun(px, nx, ptable, ntable, ptolerance, ntolerance, dppm,
+                       inomatch,
+                       idx && nx ? chunk_start(idx, ptable, ntable, px[0]) : 0,
+                       icheck, pout, last);
+    } else {
+#ifdef _OPENMP
+        #pragma omp parallel for num_threads(nc) schedule(static, 1) \
+            reduction(|:unsorted)
+#endif
+        for (int c = 0; c < nc; ++c) {
+            R_xlen_t start = nx * c / nc, end = nx * (c + 1) / nc;
+            R_xlen_t from = c || idx ?
+                chunk_start(idx, ptable, ntable, px[start]) : 0;
+            unsorted |= fun(px + start, end - start, ptable, ntable,
+                            ntolerance > 1 ? ptolerance + start : ptolerance,
+                            ntolerance, dppm, inomatch, from, icheck,
+                            index_offset(pout, start), last ? last + c : NULL);
+        }
+        /* the chunks just test their own elements */
+        for (int c = 1; icheck && c < nc; ++c) {
+            R_xlen_t b = nx * c / nc;
+            unsorted |= !(px[b] >= px[b - 1]);
+        }
+    }
+
+    if (unsorted)
+        error(UNSORTED_ERROR, tname);
+    return nc;
+}
+
+/**
+ * Find closest value to table, keep duplicates.
+ *
+ * \param x key value to look for.
+ * \param table table/haystack where to look for, or a mass index (see
+ * massIndex.c).
+ * \param tolerance allowed absolute tolerance to be accepted as match, has to
+ * be of length == 1 or length == length(x).
+ * \param ppm parts-per-million tolerance (added to tolerance), length == 1.
+ * \param nomatch value that should be returned if a key couldn't be matched.
+ * \param nthreads number of threads to use.
+ * \param check logical, test whether x and table are sorted and contain no NA.
+ * \return index the closest element
+ *
+ * \note x and table have to be sorted increasingly and not containing any NA.
+ */
+SEXP C_closest_dup_keep(SEXP x, SEXP table, SEXP tolerance, SEXP ppm,
+                        SEXP nomatch, SEXP nthreads, SEXP check) {
+    SEXP out = PROTECT(alloc_index(XLENGTH(x), table_length(table)));
+
+    closest_chunked(closest_dup_keep, x, table, tolerance, ppm, nomatch,
+                    nthreads, check, "table", out, NULL);
+
     UNPROTECT(1);
     return out;
 }
 
 /**
- * Find closest value to table, remove duplicates.
+ * Find closest value to table, keep just closest duplicates.
  *
  * \param x key value to look for.
- * \param table table/haystack where to look for.
- * \param tolerance allowed tolerance to be accepted as match, has to be of
- * length == length(x).
+ * \param table table/haystack where to look for, or a mass index (see
+ * massIndex.c).
+ * \param tolerance allowed absolute tolerance to be accepted as match, has to
+ * be of length == 1 or length == length(x).
+ * \param ppm parts-per-million tolerance (added to tolerance), length == 1.
  * \param nomatch value that should be returned if a key couldn't be matched.
+ * \param nthreads number of threads to use.
+ * \param check if non-zero, test whether x and table are sorted and contain
+ * no NA.
+ * \param tname name of table used in the error message.
  * \return index the closest element
  *
  * \note x and table have to be sorted increasingly and not containing any NA.
+ * \author Sebastian Gibb and Johannes Rainer
  */
-SEXP C_closest_dup_remove(SEXP x, SEXP table, SEXP tolerance, SEXP nomatch) {
+SEXP match_closest(SEXP x, SEXP table, SEXP tolerance, SEXP ppm,
+                   SEXP nomatch, SEXP nthreads, int check, const char *tname) {
     double *px = REAL(x);
-    const unsigned int nx = LENGTH(x);
+    const R_xlen_t nx = XLENGTH(x);
 
+    const mass_index *idx = mass_index_resolve(&table);
     double *ptable = REAL(table);
-    const unsigned int ntable1 = LENGTH(table) - 1;
+    const R_xlen_t ntable = XLENGTH(table);
 
     double *ptolerance = REAL(tolerance);
+    const R_xlen_t ntolerance = XLENGTH(tolerance);
+    const double dppm = asReal(ppm);
 
-    SEXP out = PROTECT(allocVector(INTSXP, nx));
-    int* pout = INTEGER(out);
+    if (ntolerance != 1 && ntolerance != nx)
+        error("'tolerance' has to be of length 1 or equal to 'length(x)'");
 
-    const unsigned int inomatch = asInteger(nomatch);
-    unsigned int j = 1, lastj = 0;
-    double prevdiff = R_PosInf, nextdiff = R_PosInf;
+    if (check && !idx && !is_sorted(ptable, ntable))
+        error(UNSORTED_ERROR, tname);
 
-    for (unsigned int i = 0; i < nx; ++i) {
-        while(j < ntable1 && ptable[j] < px[i])
-            ++j;
+    SEXP out = PROTECT(alloc_index(nx, ntable));
+    index_ptr pout = index_ptr_of(out);
+    const int inomatch = asInteger(nomatch);
+    const int nc = nchunks(nx, asInteger(nthreads));
 
-        /* fabs should be just needed for the first element */
-        prevdiff = fabs(px[i] - ptable[j - 1]);
-        nextdiff = fabs(ptable[j] - px[i]);
-
-        if (prevdiff <= ptolerance[i] || nextdiff <= ptolerance[i]) {
-            if (prevdiff <= nextdiff) {
-                /* match on the left */
-                if (lastj == j) {
-                    pout[i] = inomatch;
-                    pout[i - 1] = inomatch;
-                } else {
-                    pout[i] = j;
-                }
-            } else {
-                /* match on the right */
-                if (lastj == j + 1) {
-                    pout[i] = inomatch;
-                    pout[i - 1] = inomatch;
-                } else {
-                    pout[i] = ++j;
-                }
+    closest_state s = {0, idx && nx ? closest_start(idx, ptable, px[0]) : 0,
+                       -1, -1};
+
+    if (nc == 1) {
+        if (closest_dup_closest(px, nx, ptable, ntable, ptolerance,
+                                ntolerance, dppm, inomatch, pout, &s, nx,
+                                NULL, NULL, check) < 0)
+            error(UNSORTED_ERROR, tname);
+        UNPROTECT(1);
+        return out;
+    }
+
+    /* The result depends on the path through x and table. Each chunk is
+     * started from a guessed state (the table element right before its first
+     * x) and records its states. Afterwards each chunk is re-run sequentially
+     * from the real state at its start until the states converge. */
+    closest_state *states = (closest_state*) R_alloc(nc, sizeof(closest_state));
+    closest_state *cp = (closest_state*)
+        R_alloc(nx / CHECKPOINT_DIST + 1, sizeof(closest_state));
+    int unsorted = 0;
+
+#ifdef _OPENMP
+    #pragma omp parallel for num_threads(nc) schedule(static, 1) \
+        reduction(|:unsorted)
+#endif
+    for (int c = 0; c < nc; ++c) {
+        R_xlen_t start = nx * c / nc, end = nx * (c + 1) / nc;
+        closest_state cs = {start, s.itbl, -1, -1};
+        if (c)
+            cs.itbl = chunk_start(idx, ptable, ntable, px[start]);
+        unsorted |= closest_dup_closest(px, nx, ptable, ntable, ptolerance,
+                                        ntolerance, dppm, inomatch, pout, &cs,
+                                        end, cp, NULL, check) < 0;
+        states[c] = cs;
+    }
+
+    if (unsorted)
+        error(UNSORTED_ERROR, tname);
+
+    /* all elements of x were tested by the chunks above */
+    s = states[0];
+    for (int c = 1; c < nc; ++c) {
+        R_xlen_t end = nx * (c + 1) / nc;
+        if (closest_dup_closest(px, nx, ptable, ntable, ptolerance, ntolerance,
+                                dppm, inomatch, pout, &s, end, NULL, cp, 0))
+            s = states[c];
+    }
+
+    UNPROTECT(1);
+    return out;
+}
+
+/**
+ * Find closest value to table, keep just closest duplicates.
+ *
+ * \param x key value to look for.
+ * \param table table/haystack where to look for, or a mass index (see
+ * massIndex.c).
+ * \param tolerance allowed absolute tolerance to be accepted as match, has to
+ * be of length == 1 or length == length(x).
+ * \param ppm parts-per-million tolerance (added to tolerance), length == 1.
+ * \param nomatch value that should be returned if a key couldn't be matched.
+ * \param nthreads number of threads to use.
+ * \param check logical, test whether x and table are sorted and contain no NA.
+ * \return index the closest element
+ *
+ * \note x and table have to be sorted increasingly and not containing any NA.
+ */
+SEXP C_closest_dup_closest(SEXP x, SEXP table, SEXP tolerance, SEXP ppm,
+                           SEXP nomatch, SEXP nthreads, SEXP check) {
+    return match_closest(x, table, tolerance, ppm, nomatch, nthreads,
+                         asLogical(check), "table");
+}
+
+/**
+ * Find closest value to table, remove duplicates.
+ *
+ * \param x key value to look for.
+ * \param table table/haystack where to look for, or a mass index (see
+ * massIndex.c).
+ * \param tolerance allowed absolute tolerance to be accepted as match, has to
+ * be of length == 1 or length == length(x).
+ * \param ppm parts-per-million tolerance (added to tolerance), length == 1.
+ * \param nomatch value that should be returned if a key couldn't be matched.
+ * \param nthreads number of threads to use.
+ * \param check logical, test whether x and table are sorted and contain no NA.
+ * \return index the closest element
+ *
+ * \note x and table have to be sorted increasingly and not containing any NA.
+ * If multiple threads are used each chunk is started without knowing the
+ * matches of the previous one. Afterwards the first keys of each chunk are
+ * matched again (sequentially) with the real position after the previous
+ * chunk until it is identical to the position reached by the chunk itself.
+ */
+SEXP C_closest_dup_remove(SEXP x, SEXP table, SEXP tolerance, SEXP ppm,
+                          SEXP nomatch, SEXP nthreads, SEXP check) {
+    const R_xlen_t nx = XLENGTH(x);
+    SEXP out = PROTECT(alloc_index(nx, table_length(table)));
+    R_xlen_t *last = (R_xlen_t*)
+        R_alloc(nchunks(nx, asInteger(nthreads)), sizeof(R_xlen_t));
+
+    const int nc = closest_chunked(closest_dup_remove, x, table, tolerance,
+                                   ppm, nomatch, nthreads, check, "table",
+                                   out, last);
+
+    if (nc > 1) {
+        const mass_index *idx = mass_index_resolve(&table);
+        double *px = REAL(x), *ptable = REAL(table), *ptol = REAL(tolerance);
+        const R_xlen_t ntable = XLENGTH(table), ntol = XLENGTH(tolerance);
+        const double dppm = asReal(ppm);
+        index_ptr pout = index_ptr_of(out);
+        const int inomatch = asInteger(nomatch);
+        R_xlen_t j = last[0];
+
+        for (int c = 1; c < nc; ++c) {
+            R_xlen_t i = nx * c / nc, end = nx * (c + 1) / nc;
+            /* real position and the one the chunk was started with */
+            R_xlen_t jr = j, lastjr = j;
+            R_xlen_t jc = chunk_start(idx, ptable, ntable, px[i]), lastjc = 0;
+            if (jc < 1)
+                jc = 1;
+
+            for (; i < end; ++i) {
+                double tol = tolerance_at(ptol, ntol, i, px[i], dppm);
+                closest_remove_set(pout, i,
+                                   closest_remove_step(px[i], ptable, ntable,
+                                                       tol, &jr, &lastjr),
+                                   inomatch);
+                closest_remove_step(px[i], ptable, ntable, tol, &jc, &lastjc);
+                if (jr == jc)
+                    break;
             }
-        } else
-            pout[i] = inomatch;
-        lastj = j;
+            if (i < end) {
+                /* the chunk's result for the next key is correct but it
+                 * could have removed the current key, too */
+                if (i + 1 < end &&
+                        closest_remove_step(px[i + 1], ptable, ntable,
+                                            tolerance_at(ptol, ntol, i + 1,
+                                                         px[i + 1], dppm),
+                                            &jr, &lastjr) < 0)
+                    index_set(pout, i, inomatch);
+                j = last[c];
+            } else
+                j = jr;
+        }
     }
 
     UNPROTECT(1);
     return out;
 }
+
+/**
+ * Find closest values for a list of key vectors in a single table.
+ *
+ * \param x list of key values (double) to look for, each has to be sorted
+ * increasingly and must not contain any NA.
+ * \param table table/haystack where to look for, has to be sorted increasingly
+ * and must not contain any NA, or a mass index (see massIndex.c).
+ * \param tolerance allowed absolute tolerance to be accepted as match,
+ * length == 1.
+ * \param ppm parts-per-million tolerance (added to tolerance), length == 1.
+ * \param duplicates how to handle duplicates, 1: keep, 2: closest, 3: remove.
+ * \param nomatch value that should be returned if a key couldn't be matched.
+ * \param nthreads number of threads to use, the elements of x are processed in
+ * parallel.
+ * \param check logical, test whether the elements of x and table are sorted
+ * and contain no NA.
+ * \return list of indices of the closest elements.
+ */
+SEXP C_closest_list(SEXP x, SEXP table, SEXP tolerance, SEXP ppm,
+                    SEXP duplicates, SEXP nomatch, SEXP nthreads,
+                    SEXP check) {
+    const R_xlen_t n = XLENGTH(x);
+
+    const mass_index *idx = mass_index_resolve(&table);
+    double *ptable = REAL(table);
+    const R_xlen_t ntable = XLENGTH(table);
+
+    double *ptolerance = REAL(tolerance);
+    const double dppm = asReal(ppm);
+    const int dup = asInteger(duplicates);
+    const int inomatch = asInteger(nomatch);
+    const int nth = asInteger(nthreads);
+    const int icheck = asLogical(check);
+
+    if (XLENGTH(tolerance) != 1)
+        error("'tolerance' has to be of length 1");
+
+    if (icheck && !idx && !is_sorted(ptable, ntable))
+        error("all elements of " UNSORTED_ERROR, "table");
+
+    SEXP out = PROTECT(allocVector(VECSXP, n));
+    double **px = (double**) R_alloc(n, sizeof(double*));
+    index_ptr *pout = (index_ptr*) R_alloc(n, sizeof(index_ptr));
+    R_xlen_t *nx = (R_xlen_t*) R_alloc(n, sizeof(R_xlen_t));
+
+    for (R_xlen_t i = 0; i < n; ++i) {
+        SEXP xi = VECTOR_ELT(x, i);
+        if (TYPEOF(xi) != REALSXP)
+            error("all elements of 'x' have to be of type 'double'");
+        SET_VECTOR_ELT(out, i, alloc_index(XLENGTH(xi), ntable));
+        px[i] = REAL(xi);
+        nx[i] = XLENGTH(xi);
+        pout[i] = index_ptr_of(VECTOR_ELT(out, i));
+    }
+
+    int unsorted = 0;
+
+#ifdef _OPENMP
+    #pragma omp parallel for num_threads(nth > 1 ? nth : 1) \
+        schedule(dynamic) reduction(|:unsorted)
+#endif
+    for (R_xlen_t i = 0; i < n; ++i) {
+        const int start = idx && nx[i];
+        if (dup == 2) {
+            closest_state s = {0, start ? closest_start(idx, ptable, px[i][0])
+                : 0, -1, -1};
+            unsorted |= closest_dup_closest(px[i], nx[i], ptable, ntable,
+                                            ptolerance, 1, dppm, inomatch,
+                                            pout[i], &s, nx[i], NULL, NULL,
+                                            icheck) < 0;
+        } else {
+            R_xlen_t from = start ?
+                chunk_start(idx, ptable, ntable, px[i][0]) : 0;
+            if (dup == 3)
+                unsorted |= closest_dup_remove(px[i], nx[i], ptable, ntable,
+                                               ptolerance, 1, dppm, inomatch,
+                                               from, icheck, pout[i], NULL);
+            else
+                unsorted |= closest_dup_keep(px[i], nx[i], ptable, ntable,
+                                             ptolerance, 1, dppm, inomatch,
+                                             from, icheck, pout[i], NULL);
+        }
+    }
+
+    if (unsorted)
+        error("all elements of " UNSORTED_ERROR, "table");
+
+    UNPROTECT(1);
+    return out;
+}
+
+/**
+ * Find closest value to table for unsorted x and table.
+ *
+ * x and table are sorted (if necessary) by a radix sort, matched and the
+ * indices are mapped back to the original order.
+ *
+ * \param x key value to look for, must not contain any NA.
+ * \param table table/haystack where to look for, must not contain any NA, or
+ * a mass index (see massIndex.c).
+ * \param tolerance allowed absolute tolerance to be accepted as match, has to
+ * be of length == 1 or length == length(x).
+ * \param ppm parts-per-million tolerance (added to tolerance), length == 1.
+ * \param duplicates how to handle duplicates, 1: keep, 2: closest, 3: remove.
+ * \param nomatch value that should be returned if a key couldn't be matched.
+ * \param nthreads number of threads to use.
+ * \return index (in the original table) of the closest element for each
+ * element of x (in the original order).
+ */
+SEXP C_closest_unsorted(SEXP x, SEXP table, SEXP tolerance, SEXP ppm,
+                        SEXP duplicates, SEXP nomatch, SEXP nthreads) {
+    const R_xlen_t nx = XLENGTH(x), ntolerance = XLENGTH(tolerance);
+    R_xlen_t *ox = NULL, *otable = NULL;
+
+    if (ntolerance != 1 && ntolerance != nx)
+        error("'tolerance' has to be of length 1 or equal to 'length(x)'");
+
+    SEXP xs = PROTECT(sort_double(x, &ox));
+    SEXP ts = PROTECT(TYPEOF(table) == EXTPTRSXP ? table :
+                      sort_double(table, &otable));
+
+    if (isNull(xs) || isNull(ts))
+        error("'x' and 'table' must not contain NA.");
+
+    SEXP tols = tolerance;
+    if (ox && ntolerance > 1) {
+        double *ptol = REAL(tolerance);
+        tols = allocVector(REALSXP, nx);
+        double *ptols = REAL(tols);
+        for (R_xlen_t i = 0; i < nx; ++i)
+            ptols[i] = ptol[ox[i]];
+    }
+    PROTECT(tols);
+
+    /* use NA as nomatch to distinguish it from valid indices */
+    SEXP na = PROTECT(ScalarInteger(NA_INTEGER));
+    SEXP check = PROTECT(ScalarLogical(FALSE));
+    SEXP res;
+
+    switch (asInteger(duplicates)) {
+    case 2:
+        res = C_closest_dup_closest(xs, ts, tols, ppm, na, nthreads, check);
+        break;
+    case 3:
+        res = C_closest_dup_remove(xs, ts, tols, ppm, na, nthreads, check);
+        break;
+    default:
+        res = C_closest_dup_keep(xs, ts, tols, ppm, na, nthreads, check);
+    }
+    PROTECT(res);
+
+    SEXP out = PROTECT(alloc_index(nx, table_length(ts)));
+    index_ptr pres = index_ptr_of(res), pout = index_ptr_of(out);
+    const int inomatch = asInteger(nomatch);
+
+    for (R_xlen_t i = 0; i < nx; ++i) {
+        R_xlen_t r = index_get(pres, i);
+        if (r == NA_INTEGER)
+            r = inomatch;
+        else if (otable)
+            r = otable[r - 1] + 1;
+        index_set(pout, ox ? ox[i] : i, r);
+    }
+
+    UNPROTECT(7);
+    return out;
+}
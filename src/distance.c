@@ -0,0 +1,165 @@
+#include "MsCoreUtils.h"
+
+#include <R.h>
+#include <Rinternals.h>
+#include <Rmath.h>
+#include <math.h>
+
+/**
+ * Weight of a peak, x^m * y^n (see .weightxy).
+ *
+ * The common cases m = 0 and n = 0.5 avoid the expensive R_pow. R_pow is
+ * used otherwise to get the same results as `^` in R.
+ *
+ * \param x m/z.
+ * \param y intensity.
+ * \param m weighting of x.
+ * \param n weighting of y.
+ */
+static inline double weight(double x, double y, double m, double n) {
+    double w;
+
+    if (n == 0.5)
+        w = sqrt(y);
+    else if (n == 1)
+        w = y;
+    else
+        w = R_pow(y, n);
+
+    return m == 0 ? w : R_pow(x, m) * w;
+}
+
+/* add a term to a sum, NA/NaN terms are skipped if narm is set */
+#define ADD_TERM(sum, term) do { \
+    double t_ = (term); \
+    if (!(narm && ISNAN(t_))) \
+        sum += t_; \
+} while (0)
+
+/**
+ * Normalized dot product of two aligned spectra.
+ *
+ * All three sums are calculated in a single pass. Like in sum(na.rm = TRUE)
+ * NA terms are removed for each sum separately.
+ *
+ * \param xmz, xint m/z and intensity values of the first spectrum.
+ * \param ymz, yint m/z and intensity values of the second spectrum.
+ * \param nr number of (aligned) peaks.
+ * \param m weighting of the m/z values.
+ * \param n weighting of the intensity values.
+ * \param narm if non-zero, NA terms are removed.
+ */
+double ndotproduct(const double *xmz, const double *xint,
+                   const double *ymz, const double *yint, R_xlen_t nr,
+                   double m, double n, int narm) {
+    long double xy = 0, xx = 0, yy = 0;
+
+    for (R_xlen_t i = 0; i < nr; ++i) {
+        const double wx = weight(xmz[i], xint[i], m, n);
+        const double wy = weight(ymz[i], yint[i], m, n);
+        ADD_TERM(xy, wx * wy);
+        ADD_TERM(xx, wx * wx);
+        ADD_TERM(yy, wy * wy);
+    }
+    const double sxy = xy;
+    return sxy * sxy / ((double)xx * (double)yy);
+}
+
+/**
+ * Normalized euclidean distance of two aligned spectra.
+ *
+ * See ndotproduct for the parameters.
+ */
+double neuclidean(const double *xmz, const double *xint,
+                  const double *ymz, const double *yint, R_xlen_t nr,
+                  double m, double n, int narm) {
+    long double d = 0, yy = 0;
+
+    for (R_xlen_t i = 0; i < nr; ++i) {
+        const double wx = weight(xmz[i], xint[i], m, n);
+        const double wy = weight(ymz[i], yint[i], m, n);
+        ADD_TERM(d, (wy - wx) * (wy - wx));
+        ADD_TERM(yy, wy * wy);
+    }
+    return 1 / (1 + (double)d / (double)yy);
+}
+
+/**
+ * Normalized absolute values distance of two aligned spectra.
+ *
+ * See ndotproduct for the parameters.
+ */
+double navdist(const double *xmz, const double *xint,
+               const double *ymz, const double *yint, R_xlen_t nr,
+               double m, double n, int narm) {
+    long double d = 0, y = 0;
+
+    for (R_xlen_t i = 0; i < nr; ++i) {
+        const double wx = weight(xmz[i], xint[i], m, n);
+        const double wy = weight(ymz[i], yint[i], m, n);
+        ADD_TERM(d, fabs(wy - wx));
+        ADD_TERM(y, wy);
+    }
+    return 1 / (1 + (double)d / (double)y);
+}
+
+/**
+ * Normalized spectra angle of two aligned spectra.
+ *
+ * See ndotproduct for the parameters.
+ */
+double nspectraangle(const double *xmz, const double *xint,
+                     const double *ymz, const double *yint, R_xlen_t nr,
+                     double m, double n, int narm) {
+    return 1 - 2 * acos(ndotproduct(xmz, xint, ymz, yint, nr, m, n, narm)) /
+        M_PI;
+}
+
+#undef ADD_TERM
+
+/**
+ * Call a similarity function for two peak matrices.
+ *
+ * \param fun similarity function.
+ * \param x, y numeric matrices with (at least) two columns, m/z and
+ * intensity, and the same number of rows.
+ * \param m weighting of the m/z values.
+ * \param n weighting of the intensity values.
+ * \param narm logical, should NA be removed?
+ * \return similarity.
+ */
+static SEXP similarity(similarity_fun fun, SEXP x, SEXP y, SEXP m, SEXP n,
+                       SEXP narm) {
+    if (!isMatrix(x) || !isMatrix(y) || ncols(x) < 2 || ncols(y) < 2)
+        error("'x' and 'y' have to be matrices with two columns");
+
+    const R_xlen_t nr = nrows(x);
+    if (nrows(y) != nr)
+        error("'x' and 'y' have to have the same number of rows");
+
+    PROTECT(x = coerceVector(x, REALSXP));
+    PROTECT(y = coerceVector(y, REALSXP));
+    const double *px = REAL(x), *py = REAL(y);
+
+    double s = fun(px, px + nr, py, py + nr, nr, asReal(m), asReal(n),
+                   asLogical(narm) == TRUE);
+
+    UNPROTECT(2);
+    return ScalarReal(s);
+}
+
+SEXP C_ndotproduct(SEXP x, SEXP y, SEXP m, SEXP n, SEXP narm) {
+    return similarity(ndotproduct, x, y, m, n, narm);
+}
+
+SEXP C_neuclidean(SEXP x, SEXP y, SEXP m, SEXP n, SEXP narm) {
+    return similarity(neuclidean, x, y, m, n, narm);
+}
+
+SEXP C_navdist(SEXP x, SEXP y, SEXP m, SEXP n, SEXP narm) {
+    return similarity(navdist, x, y, m, n, narm);
+}
+
+SEXP C_nspectraangle(SEXP x, SEXP y, SEXP m, SEXP n, SEXP narm) {
+    return similarity(nspectraangle, x, y, m, n, narm);
+}
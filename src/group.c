@@ -0,0 +1,57 @@
+#include "MsCoreUtils.h"
+
+#include <R.h>
+#include <Rinternals.h>
+#include <float.h>
+#include <math.h>
+
+/**
+ * Group values by similarity.
+ *
+ * Consecutive (ordered) values are put into the same group if their
+ * difference is smaller than tolerance + ppm of the smaller value. The group
+ * ids are written directly in a single pass over the values (or their radix
+ * order if x is not sorted), no vectors of differences or tolerances are
+ * created.
+ *
+ * \param x double, values to group, must not contain NA.
+ * \param tolerance allowed absolute difference, length == 1.
+ * \param ppm parts-per-million difference, length == 1.
+ * \return group ids (1-based, increasing with the values) for each element
+ * of x.
+ */
+SEXP C_group(SEXP x, SEXP tolerance, SEXP ppm) {
+    const R_xlen_t n = XLENGTH(x);
+    const double *px = REAL(x);
+
+    if (XLENGTH(tolerance) != 1 || XLENGTH(ppm) != 1)
+        error("'tolerance' and 'ppm' have to be 'numeric' of length one.");
+
+    const double tol = REAL(tolerance)[0] + sqrt(DBL_EPSILON);
+    const double dppm = REAL(ppm)[0];
+
+    R_xlen_t *o = NULL;
+    if (!is_sorted(px, n)) {
+        o = (R_xlen_t*) R_alloc(n, sizeof(R_xlen_t));
+        if (radix_order(px, n, o))
+            error("'x' must not contain NA.");
+    }
+
+    SEXP out = PROTECT(alloc_index(n, n));
+    index_ptr pout = index_ptr_of(out);
+
+    R_xlen_t g = 1;
+    double prev = 0;
+    for (R_xlen_t i = 0; i < n; ++i) {
+        const R_xlen_t j = o ? o[i] : i;
+        const double v = px[j];
+
+        if (i && v - prev >= (dppm > 0 ? tol + prev * dppm * 1e-6 : tol))
+            ++g;
+        index_set(pout, j, g);
+        prev = v;
+    }
+
+    UNPROTECT(1);
+    return out;
+}
@@ -1,15 +1,37 @@
 #include "MsCoreUtils.h"
 
 static const R_CallMethodDef CallEntries[] = {
-    {"C_closest_dup_keep", (DL_FUNC) &C_closest_dup_keep, 4},
-    {"C_closest_dup_closest", (DL_FUNC) &C_closest_dup_closest, 4},
-    {"C_closest_dup_remove", (DL_FUNC) &C_closest_dup_remove, 4},
+    {"C_bin", (DL_FUNC) &C_bin, 4},
+    {"C_bin_index", (DL_FUNC) &C_bin_index, 2},
+    {"C_bin_list", (DL_FUNC) &C_bin_list, 5},
+    {"C_bin_ppm", (DL_FUNC) &C_bin_ppm, 6},
+    {"C_bin_ppm_index", (DL_FUNC) &C_bin_ppm_index, 4},
+    {"C_closest_dup_keep", (DL_FUNC) &C_closest_dup_keep, 7},
+    {"C_closest_dup_closest", (DL_FUNC) &C_closest_dup_closest, 7},
+    {"C_closest_dup_remove", (DL_FUNC) &C_closest_dup_remove, 7},
+    {"C_closest_list", (DL_FUNC) &C_closest_list, 8},
+    {"C_closest_unsorted", (DL_FUNC) &C_closest_unsorted, 7},
+    {"C_coefSG", (DL_FUNC) &C_coefSG, 2},
+    {"C_group", (DL_FUNC) &C_group, 3},
     {"C_impNeighbourAvg", (DL_FUNC) &C_impNeighbourAvg, 2},
-    {"C_join_left", (DL_FUNC) &C_join_left, 4},
-    {"C_join_right", (DL_FUNC) &C_join_right, 4},
-    {"C_join_inner", (DL_FUNC) &C_join_inner, 4},
-    {"C_join_outer", (DL_FUNC) &C_join_outer, 4},
-    {"C_localMaxima", (DL_FUNC) &C_localMaxima, 2},
+    {"C_join_left", (DL_FUNC) &C_join_left, 8},
+    {"C_join_right", (DL_FUNC) &C_join_right, 8},
+    {"C_join_inner", (DL_FUNC) &C_join_inner, 8},
+    {"C_join_outer", (DL_FUNC) &C_join_outer, 7},
+    {"C_join_all", (DL_FUNC) &C_join_all, 6},
+    {"C_join_unsorted", (DL_FUNC) &C_join_unsorted, 8},
+    {"C_library_search", (DL_FUNC) &C_library_search, 14},
+    {"C_localMaxima", (DL_FUNC) &C_localMaxima, 3},
+    {"C_local_maxima_list", (DL_FUNC) &C_local_maxima_list, 3},
+    {"C_mass_index", (DL_FUNC) &C_mass_index, 2},
+    {"C_mass_index_table", (DL_FUNC) &C_mass_index_table, 1},
+    {"C_navdist", (DL_FUNC) &C_navdist, 5},
+    {"C_ndotproduct", (DL_FUNC) &C_ndotproduct, 5},
+    {"C_neuclidean", (DL_FUNC) &C_neuclidean, 5},
+    {"C_nspectraangle", (DL_FUNC) &C_nspectraangle, 5},
+    {"C_similarity_matrix", (DL_FUNC) &C_similarity_matrix, 9},
+    {"C_smooth", (DL_FUNC) &C_smooth, 2},
+    {"C_smooth_matrix", (DL_FUNC) &C_smooth_matrix, 4},
     {NULL, NULL, 0}
 };
 
@@ -6,167 +6,286 @@
 #include <Rmath.h>
 
 /**
- * Left join of two increasingly sorted arrays.
+ * Allocate the value columns of a join.
  *
- * \param x array, has to be sorted increasingly and not contain any NA.
- * \param y array, has to be sorted increasingly and not contain any NA.
- * \param tolerance allowed tolerance to be accepted as match, has to be of
- * length == length(x).
- * \param nomatch value that should be returned if a key couldn't be matched.
- * \author Sebastian Gibb
+ * \param values logical, should the values be reported?
+ * \param n number of rows.
+ * \param v output, pointers to the columns.
+ * \return list of the columns (unprotected) or R_NilValue.
  */
-SEXP C_join_left(SEXP x, SEXP y, SEXP tolerance, SEXP nomatch) {
-    SEXP ry = PROTECT(C_closest_dup_closest(x, y, tolerance, nomatch));
-    const unsigned int ny = LENGTH(ry);
+static SEXP alloc_values(SEXP values, R_xlen_t n, join_values *v) {
+    v->x = v->y = v->delta = v->ppm = NULL;
+
+    if (asLogical(values) != TRUE)
+        return R_NilValue;
+
+    SEXP cols = PROTECT(allocVector(VECSXP, 4));
+    for (int i = 0; i < 4; ++i)
+        SET_VECTOR_ELT(cols, i, allocVector(REALSXP, n));
+    v->x = REAL(VECTOR_ELT(cols, 0));
+    v->y = REAL(VECTOR_ELT(cols, 1));
+    v->delta = REAL(VECTOR_ELT(cols, 2));
+    v->ppm = REAL(VECTOR_ELT(cols, 3));
+    UNPROTECT(1);
+    return cols;
+}
 
-    SEXP rx = PROTECT(allocVector(INTSXP, ny));
-    int* px = INTEGER(rx);
+/**
+ * Store the values of a pair and their (signed) differences.
+ *
+ * \param x value of x or NA_REAL if there is no x in this row.
+ * \param y value of y or NA_REAL if there is no y in this row.
+ */
+static inline void set_values(const join_values *v, R_xlen_t k,
+                              double x, double y) {
+    if (!v->x)
+        return;
+    v->x[k] = x;
+    v->y[k] = y;
+    v->delta[k] = x - y;
+    v->ppm[k] = (x - y) / y * 1e6;
+}
 
-    for (unsigned int i = 0; i < ny; ++i)
-        px[i] = i + 1;
+/**
+ * Value at a 1-based index, NA_REAL for nomatch.
+ */
+static inline double value_at(const double *p, R_xlen_t i, int nomatch) {
+    return i == nomatch ? NA_REAL : p[i - 1];
+}
+
+/**
+ * Create the result of a join.
+ *
+ * \param rx, ry indices in x and y.
+ * \param cols value columns created by alloc_values or R_NilValue.
+ * \param n number of rows, all columns are shortened to n.
+ * \return named list with the columns x, y and (if requested) xValue,
+ * yValue, delta and deltaPpm.
+ */
+static SEXP join_result(SEXP rx, SEXP ry, SEXP cols, R_xlen_t n) {
+    const char *names[] = {"x", "y", "xValue", "yValue", "delta", "deltaPpm"};
+    const int nc = isNull(cols) ? 2 : 6;
 
-    SEXP out = PROTECT(allocVector(VECSXP, 2));
-    SEXP nms = PROTECT(allocVector(STRSXP, 2));
+    SEXP out = PROTECT(allocVector(VECSXP, nc));
+    SEXP nms = PROTECT(allocVector(STRSXP, nc));
     SET_VECTOR_ELT(out, 0, rx);
     SET_VECTOR_ELT(out, 1, ry);
-    SET_STRING_ELT(nms, 0, mkChar("x"));
-    SET_STRING_ELT(nms, 1, mkChar("y"));
+    for (int i = 2; i < nc; ++i)
+        SET_VECTOR_ELT(out, i, VECTOR_ELT(cols, i - 2));
+    for (int i = 0; i < nc; ++i) {
+        if (XLENGTH(VECTOR_ELT(out, i)) != n)
+            SETLENGTH(VECTOR_ELT(out, i), n);
+        SET_STRING_ELT(nms, i, mkChar(names[i]));
+    }
     setAttrib(out, R_NamesSymbol, nms);
 
-    UNPROTECT(4);
-
+    UNPROTECT(2);
     return out;
 }
 
 /**
- * Right join of two increasingly sorted arrays.
+ * Left join of two increasingly sorted arrays.
  *
  * \param x array, has to be sorted increasingly and not contain any NA.
- * \param y array, has to be sorted increasingly and not contain any NA.
- * \param tolerance allowed tolerance to be accepted as match, has to be of
- * length == length(x).
+ * \param y array, has to be sorted increasingly and not contain any NA, or a
+ * mass index (see massIndex.c).
+ * \param tolerance allowed absolute tolerance to be accepted as match, has to
+ * be of length == 1 or length == length(x).
+ * \param ppm parts-per-million tolerance (added to tolerance), length == 1.
  * \param nomatch value that should be returned if a key couldn't be matched.
+ * \param nthreads number of threads to use.
+ * \param check logical, test whether x and y are sorted and contain no NA.
+ * \param values logical, report the values and their differences, too.
  * \author Sebastian Gibb
  */
-SEXP C_join_right(SEXP x, SEXP y, SEXP tolerance, SEXP nomatch) {
-    SEXP c = PROTECT(C_closest_dup_closest(x, y, tolerance, nomatch));
-    int* pc = INTEGER(c);
-    const unsigned int nc = LENGTH(c);
-
+SEXP C_join_left(SEXP x, SEXP y, SEXP tolerance, SEXP ppm,
+                 SEXP nomatch, SEXP nthreads, SEXP check, SEXP values) {
+    SEXP ry = PROTECT(match_closest(x, y, tolerance, ppm, nomatch, nthreads,
+                                    asLogical(check), "y"));
+    index_ptr py = index_ptr_of(ry);
+    const R_xlen_t ny = XLENGTH(ry);
+
+    SEXP rx = PROTECT(alloc_index(ny, ny));
+    index_ptr px = index_ptr_of(rx);
+
+    join_values v;
+    SEXP cols = PROTECT(alloc_values(values, ny, &v));
     const int inomatch = asInteger(nomatch);
+    const double *pix = REAL(x);
+    mass_index_resolve(&y);
+    const double *piy = REAL(y);
 
-    const unsigned int ny = LENGTH(y);
-    SEXP rx = PROTECT(allocVector(INTSXP, ny));
-    int* px = INTEGER(rx);
-    SEXP ry = PROTECT(allocVector(INTSXP, ny));
-    int* py = INTEGER(ry);
-
-    for (unsigned int i = 0; i < ny; ++i) {
-        px[i] = inomatch;
-        py[i] = i + 1;
+    for (R_xlen_t i = 0; i < ny; ++i) {
+        index_set(px, i, i + 1);
+        set_values(&v, i, pix[i], value_at(piy, index_get(py, i), inomatch));
     }
-    for (unsigned int i = 0; i < nc; ++i) {
-        if (pc[i] != inomatch)
-            px[pc[i] - 1] = i + 1;
-    }
-
-    SEXP out = PROTECT(allocVector(VECSXP, 2));
-    SEXP nms = PROTECT(allocVector(STRSXP, 2));
-    SET_VECTOR_ELT(out, 0, rx);
-    SET_VECTOR_ELT(out, 1, ry);
-    SET_STRING_ELT(nms, 0, mkChar("x"));
-    SET_STRING_ELT(nms, 1, mkChar("y"));
-    setAttrib(out, R_NamesSymbol, nms);
 
-    UNPROTECT(5);
+    SEXP out = join_result(rx, ry, cols, ny);
+    UNPROTECT(3);
 
     return out;
 }
 
 /**
- * Inner join of two increasingly sorted arrays.
+ * Right join of two increasingly sorted arrays.
  *
  * \param x array, has to be sorted increasingly and not contain any NA.
- * \param y array, has to be sorted increasingly and not contain any NA.
- * \param tolerance allowed tolerance to be accepted as match, has to be of
- * length == length(x).
+ * \param y array, has to be sorted increasingly and not contain any NA, or a
+ * mass index (see massIndex.c).
+ * \param tolerance allowed absolute tolerance to be accepted as match, has to
+ * be of length == 1 or length == length(x).
+ * \param ppm parts-per-million tolerance (added to tolerance), length == 1.
  * \param nomatch value that should be returned if a key couldn't be matched.
+ * \param nthreads number of threads to use.
+ * \param check logical, test whether x and y are sorted and contain no NA.
+ * \param values logical, report the values and their differences, too.
  * \author Sebastian Gibb
  */
-SEXP C_join_inner(SEXP x, SEXP y, SEXP tolerance, SEXP nomatch) {
-    SEXP ry = PROTECT(C_closest_dup_closest(x, y, tolerance, nomatch));
-    int* py = INTEGER(ry);
-    const unsigned int ny = LENGTH(ry);
-
-    SEXP rx = PROTECT(allocVector(INTSXP, ny));
-    int* px = INTEGER(rx);
+SEXP C_join_right(SEXP x, SEXP y, SEXP tolerance, SEXP ppm,
+                  SEXP nomatch, SEXP nthreads, SEXP check, SEXP values) {
+    SEXP c = PROTECT(match_closest(x, y, tolerance, ppm, nomatch, nthreads,
+                                   asLogical(check), "y"));
+    index_ptr pc = index_ptr_of(c);
+    const R_xlen_t nc = XLENGTH(c);
 
     const int inomatch = asInteger(nomatch);
-    unsigned int j = 0;
 
-    for (unsigned int i = 0; i < ny; ++i) {
-        if (py[i] != inomatch) {
-            px[j] = i + 1;
-            py[j] = py[i];
-            ++j;
+    mass_index_resolve(&y);
+    const R_xlen_t ny = XLENGTH(y);
+    SEXP rx = PROTECT(alloc_index(ny, nc));
+    index_ptr px = index_ptr_of(rx);
+    SEXP ry = PROTECT(alloc_index(ny, ny));
+    index_ptr py = index_ptr_of(ry);
+
+    join_values v;
+    SEXP cols = PROTECT(alloc_values(values, ny, &v));
+    const double *pix = REAL(x), *piy = REAL(y);
+
+    for (R_xlen_t i = 0; i < ny; ++i) {
+        index_set(px, i, inomatch);
+        index_set(py, i, i + 1);
+        set_values(&v, i, NA_REAL, piy[i]);
+    }
+    for (R_xlen_t i = 0; i < nc; ++i) {
+        R_xlen_t j = index_get(pc, i);
+        if (j != inomatch) {
+            index_set(px, j - 1, i + 1);
+            set_values(&v, j - 1, pix[i], piy[j - 1]);
         }
     }
-    SETLENGTH(rx, j);
-    SETLENGTH(ry, j);
-    SEXP out = PROTECT(allocVector(VECSXP, 2));
-    SEXP nms = PROTECT(allocVector(STRSXP, 2));
-    SET_VECTOR_ELT(out, 0, rx);
-    SET_VECTOR_ELT(out, 1, ry);
-    SET_STRING_ELT(nms, 0, mkChar("x"));
-    SET_STRING_ELT(nms, 1, mkChar("y"));
-    setAttrib(out, R_NamesSymbol, nms);
 
+    SEXP out = join_result(rx, ry, cols, ny);
     UNPROTECT(4);
 
     return out;
 }
 
 /**
- * Outer join of two increasingly sorted arrays.
+ * Inner join of two increasingly sorted arrays.
  *
  * \param x array, has to be sorted increasingly and not contain any NA.
- * \param y array, has to be sorted increasingly and not contain any NA.
- * \param tolerance allowed tolerance to be accepted as match, has to be of
- * length == length(x).
+ * \param y array, has to be sorted increasingly and not contain any NA, or a
+ * mass index (see massIndex.c).
+ * \param tolerance allowed absolute tolerance to be accepted as match, has to
+ * be of length == 1 or length == length(x).
+ * \param ppm parts-per-million tolerance (added to tolerance), length == 1.
  * \param nomatch value that should be returned if a key couldn't be matched.
- * \author Johannes Rainer, Sebastian Gibb
+ * \param nthreads number of threads to use.
+ * \param check logical, test whether x and y are sorted and contain no NA.
+ * \param values logical, report the values and their differences, too.
+ * \author Sebastian Gibb
  */
-SEXP C_join_outer(SEXP x, SEXP y, SEXP tolerance, SEXP nomatch) {
-    double *pix = REAL(x);
-    const unsigned int nx = LENGTH(x);
-    double *piy = REAL(y);
-    const unsigned int ny = LENGTH(y);
-
-    double *ptolerance = REAL(tolerance);
+SEXP C_join_inner(SEXP x, SEXP y, SEXP tolerance, SEXP ppm,
+                  SEXP nomatch, SEXP nthreads, SEXP check, SEXP values) {
+    SEXP ry = PROTECT(match_closest(x, y, tolerance, ppm, nomatch, nthreads,
+                                    asLogical(check), "y"));
+    index_ptr py = index_ptr_of(ry);
+    const R_xlen_t ny = XLENGTH(ry);
+
+    SEXP rx = PROTECT(alloc_index(ny, ny));
+    index_ptr px = index_ptr_of(rx);
+
+    join_values v;
+    SEXP cols = PROTECT(alloc_values(values, ny, &v));
+    const double *pix = REAL(x);
+    mass_index_resolve(&y);
+    const double *piy = REAL(y);
 
-    const unsigned int inomatch = asInteger(nomatch);
+    const int inomatch = asInteger(nomatch);
+    R_xlen_t j = 0;
+
+    for (R_xlen_t i = 0; i < ny; ++i) {
+        R_xlen_t k = index_get(py, i);
+        if (k != inomatch) {
+            index_set(px, j, i + 1);
+            index_set(py, j, k);
+            set_values(&v, j, pix[i], piy[k - 1]);
+            ++j;
+        }
+    }
 
-    SEXP rx = PROTECT(allocVector(INTSXP, nx + ny));
-    SEXP ry = PROTECT(allocVector(INTSXP, nx + ny));
+    SEXP out = join_result(rx, ry, cols, j);
+    UNPROTECT(3);
 
-    int* prx = INTEGER(rx);
-    int* pry = INTEGER(ry);
+    return out;
+}
 
-    unsigned int i = 0, ix = 0, iy = 0;
+/**
+ * Outer join of two increasingly sorted arrays.
+ *
+ * The merge does not use the R API and could be called from multiple
+ * threads.
+ *
+ * \param pix, piy arrays, have to be sorted increasingly and must not contain
+ * any NA.
+ * \param nx, ny length of pix and piy.
+ * \param ptolerance allowed absolute tolerance, length 1 or nx.
+ * \param ntolerance length of ptolerance.
+ * \param dppm parts-per-million tolerance (added to tolerance).
+ * \param inomatch value that should be returned if a key couldn't be matched.
+ * \param checkx, checky if non-zero, test whether pix/piy are sorted and
+ * contain no NA while joining.
+ * \param prx, pry output, indices of the rows, length >= nx + ny.
+ * \param v output, values of the rows (if requested).
+ * \return number of rows or -1 if pix or piy are not sorted or contain NA.
+ * \author Johannes Rainer, Sebastian Gibb
+ */
+R_xlen_t join_outer(const double *pix, R_xlen_t nx,
+                    const double *piy, R_xlen_t ny,
+                    const double *ptolerance, R_xlen_t ntolerance,
+                    double dppm, int inomatch, int checkx, int checky,
+                    index_ptr prx, index_ptr pry, const join_values *v) {
+    /* elements below cx/cy have already been tested */
+    R_xlen_t i = 0, ix = 0, iy = 0, cx = 0, cy = 0;
+    /* indices of the current row */
+    R_xlen_t jx, jy;
     double diff = R_PosInf, diffnxtx = R_PosInf, diffnxty = R_PosInf, diffnxtxy = R_PosInf;
+    double tol = 0;
 
     while (ix < nx || iy < ny) {
+        if (checkx && ix < nx && ix >= cx) {
+            if (!(pix[ix] >= (ix ? pix[ix - 1] : R_NegInf)))
+                return -1;
+            cx = ix + 1;
+        }
+        if (checky && iy < ny && iy >= cy) {
+            if (!(piy[iy] >= (iy ? piy[iy - 1] : R_NegInf)))
+                return -1;
+            cy = iy + 1;
+        }
         if (ix >= nx) {
-            prx[i] = inomatch;
-            pry[i] = ++iy;
+            jx = inomatch;
+            jy = ++iy;
         } else if (iy >= ny) {
-            prx[i] = ++ix;
-            pry[i] = inomatch;
+            jx = ++ix;
+            jy = inomatch;
         } else {
             /* difference for current pair */
             diff = fabs(pix[ix] - piy[iy]);
 
-            if (diff <= ptolerance[ix]) {
+            tol = tolerance_at(ptolerance, ntolerance, ix, pix[ix], dppm);
+
+            if (diff <= tol) {
                 /* difference for next pairs */
                 diffnxtx =
                     ix + 1 < nx ? fabs(pix[ix + 1] - piy[iy]) : R_PosInf;
@@ -178,40 +297,284 @@ SEXP C_join_outer(SEXP x, SEXP y, SEXP tolerance, SEXP nomatch) {
                 if ((diffnxtx < diff && diffnxtx < diffnxtxy) ||
                         (diffnxty < diff && diffnxty < diffnxtxy)) {
                     if (diffnxtx < diffnxty) {
-                        prx[i] = ++ix;
-                        pry[i] = inomatch;
+                        jx = ++ix;
+                        jy = inomatch;
                     } else {
-                        prx[i] = inomatch;
-                        pry[i] = ++iy;
+                        jx = inomatch;
+                        jy = ++iy;
                     }
                 } else {
-                    prx[i] = ++ix;
-                    pry[i] = ++iy;
+                    jx = ++ix;
+                    jy = ++iy;
                 }
             } else {
                 if (pix[ix] < piy[iy]) {
-                    prx[i] = ++ix;
-                    pry[i] = inomatch;
+                    jx = ++ix;
+                    jy = inomatch;
                 } else {
-                    prx[i] = inomatch;
-                    pry[i] = ++iy;
+                    jx = inomatch;
+                    jy = ++iy;
                 }
             }
         }
+        index_set(prx, i, jx);
+        index_set(pry, i, jy);
+        set_values(v, i, value_at(pix, jx, inomatch),
+                   value_at(piy, jy, inomatch));
         ++i;
     }
+    return i;
+}
 
-    SETLENGTH(rx, i);
-    SETLENGTH(ry, i);
-    SEXP out = PROTECT(allocVector(VECSXP, 2));
-    SEXP nms = PROTECT(allocVector(STRSXP, 2));
-    SET_VECTOR_ELT(out, 0, rx);
-    SET_VECTOR_ELT(out, 1, ry);
-    SET_STRING_ELT(nms, 0, mkChar("x"));
-    SET_STRING_ELT(nms, 1, mkChar("y"));
-    setAttrib(out, R_NamesSymbol, nms);
+/**
+ * Outer join of two increasingly sorted arrays.
+ *
+ * \param x array, has to be sorted increasingly and not contain any NA.
+ * \param y array, has to be sorted increasingly and not contain any NA, or a
+ * mass index (see massIndex.c).
+ * \param tolerance allowed absolute tolerance to be accepted as match, has to
+ * be of length == 1 or length == length(x).
+ * \param ppm parts-per-million tolerance (added to tolerance), length == 1.
+ * \param nomatch value that should be returned if a key couldn't be matched.
+ * \param check logical, test whether x and y are sorted and contain no NA
+ * while joining.
+ * \param values logical, report the values and their differences, too.
+ * \author Johannes Rainer, Sebastian Gibb
+ */
+SEXP C_join_outer(SEXP x, SEXP y, SEXP tolerance, SEXP ppm,
+                  SEXP nomatch, SEXP check, SEXP values) {
+    double *pix = REAL(x);
+    const R_xlen_t nx = XLENGTH(x);
+    const int checkx = asLogical(check);
+    const int checky = checkx && !mass_index_resolve(&y);
+    double *piy = REAL(y);
+    const R_xlen_t ny = XLENGTH(y);
 
-    UNPROTECT(4);
+    double *ptolerance = REAL(tolerance);
+    const R_xlen_t ntolerance = XLENGTH(tolerance);
+    const double dppm = asReal(ppm);
+
+    if (ntolerance != 1 && ntolerance != nx)
+        error("'tolerance' has to be of length 1 or equal to 'length(x)'");
+
+    const int inomatch = asInteger(nomatch);
+
+    SEXP rx = PROTECT(alloc_index(nx + ny, nx));
+    SEXP ry = PROTECT(alloc_index(nx + ny, ny));
+
+    join_values v;
+    SEXP cols = PROTECT(alloc_values(values, nx + ny, &v));
+
+    const R_xlen_t n = join_outer(pix, nx, piy, ny, ptolerance, ntolerance,
+                                  dppm, inomatch, checkx, checky,
+                                  index_ptr_of(rx), index_ptr_of(ry), &v);
+    if (n < 0)
+        error(UNSORTED_ERROR, "y");
+
+    SEXP out = join_result(rx, ry, cols, n);
+    UNPROTECT(3);
 
     return out;
 }
+
+/**
+ * Find all pairs of x and y within tolerance.
+ *
+ * For each element of x the window of matching elements in y is moved along
+ * y (two pointers). The lower end of the window is moved backwards if the
+ * tolerance of the current element is larger than the one of the previous
+ * element.
+ *
+ * \param prx, pry output, 1-based indices of the pairs. If prx.i and prx.d
+ * are NULL the pairs are just counted.
+ * \param v output, values of the pairs (if requested).
+ * \param check if non-zero, test whether x is sorted and contains no NA.
+ * \return number of pairs or -1 if x is not sorted or contains NA.
+ */
+static R_xlen_t join_all(const double *px, R_xlen_t nx, const double *py,
+                         R_xlen_t ny, const double *ptolerance,
+                         R_xlen_t ntolerance, double ppm, R_xlen_t lo,
+                         int check, index_ptr prx, index_ptr pry,
+                         const join_values *v) {
+    const int count = !prx.i && !prx.d;
+    R_xlen_t k = 0;
+
+    for (R_xlen_t i = 0; i < nx; ++i) {
+        if (check && !(px[i] >= (i ? px[i - 1] : R_NegInf)))
+            return -1;
+
+        double tol = tolerance_at(ptolerance, ntolerance, i, px[i], ppm);
+
+        while (lo < ny && px[i] - py[lo] > tol)
+            ++lo;
+        while (lo > 0 && px[i] - py[lo - 1] <= tol)
+            --lo;
+
+        for (R_xlen_t j = lo; j < ny && py[j] - px[i] <= tol; ++j, ++k) {
+            if (!count) {
+                index_set(prx, k, i + 1);
+                index_set(pry, k, j + 1);
+                set_values(v, k, px[i], py[j]);
+            }
+        }
+    }
+    return k;
+}
+
+/**
+ * Join of two increasingly sorted arrays reporting all pairs.
+ *
+ * In contrast to the other joins every element could be part of multiple
+ * pairs. The pairs are counted in a first pass to allocate the result.
+ *
+ * \param x array, has to be sorted increasingly and not contain any NA.
+ * \param y array, has to be sorted increasingly and not contain any NA, or a
+ * mass index (see massIndex.c).
+ * \param tolerance allowed absolute tolerance to be accepted as match, has to
+ * be of length == 1 or length == length(x).
+ * \param ppm parts-per-million tolerance (added to tolerance), length == 1.
+ * \param check logical, test whether x and y are sorted and contain no NA.
+ * \param values logical, report the values and their differences, too.
+ * \return list with the indices of all pairs in x and y that are within
+ * tolerance, ordered by x and y.
+ */
+SEXP C_join_all(SEXP x, SEXP y, SEXP tolerance, SEXP ppm, SEXP check,
+                SEXP values) {
+    double *px = REAL(x);
+    const R_xlen_t nx = XLENGTH(x);
+    const int icheck = asLogical(check);
+    const mass_index *idx = mass_index_resolve(&y);
+    double *py = REAL(y);
+    const R_xlen_t ny = XLENGTH(y);
+
+    double *ptolerance = REAL(tolerance);
+    const R_xlen_t ntolerance = XLENGTH(tolerance);
+    const double dppm = asReal(ppm);
+
+    if (ntolerance != 1 && ntolerance != nx)
+        error("'tolerance' has to be of length 1 or equal to 'length(x)'");
+
+    if (icheck && !idx && !is_sorted(py, ny))
+        error(UNSORTED_ERROR, "y");
+
+    /* start next to the first possible match */
+    R_xlen_t lo = 0;
+    if (idx && nx && ny)
+        lo = mass_index_lookup(idx, py, px[0] -
+                               tolerance_at(ptolerance, ntolerance, 0, px[0],
+                                            dppm));
+
+    index_ptr none = {NULL, NULL};
+    join_values v = {NULL, NULL, NULL, NULL};
+    const R_xlen_t n = join_all(px, nx, py, ny, ptolerance, ntolerance, dppm,
+                                lo, icheck, none, none, &v);
+
+    if (n < 0)
+        error(UNSORTED_ERROR, "y");
+
+    SEXP rx = PROTECT(alloc_index(n, nx));
+    SEXP ry = PROTECT(alloc_index(n, ny));
+    SEXP cols = PROTECT(alloc_values(values, n, &v));
+
+    join_all(px, nx, py, ny, ptolerance, ntolerance, dppm, lo, 0,
+             index_ptr_of(rx), index_ptr_of(ry), &v);
+
+    SEXP out = join_result(rx, ry, cols, n);
+    UNPROTECT(3);
+
+    return out;
+}
+
+/**
+ * Map indices of a sorted array back to the original order.
+ *
+ * \param idx 1-based indices (or NA) into the sorted array, modified in place.
+ * \param order 0-based order of the original array, NULL if it was sorted.
+ */
+static void unsort_index(SEXP idx, const R_xlen_t *order) {
+    if (!order)
+        return;
+
+    index_ptr p = index_ptr_of(idx);
+    const R_xlen_t n = XLENGTH(idx);
+
+    for (R_xlen_t i = 0; i < n; ++i) {
+        R_xlen_t j = index_get(p, i);
+        if (j != NA_INTEGER)
+            index_set(p, i, order[j - 1] + 1);
+    }
+}
+
+/**
+ * Join of two unsorted arrays.
+ *
+ * x and y are sorted (if necessary) by a radix sort, joined and the indices
+ * are mapped back to the original order.
+ *
+ * \param x array, must not contain any NA.
+ * \param y array, must not contain any NA, or a mass index (see massIndex.c).
+ * \param tolerance allowed absolute tolerance to be accepted as match, has to
+ * be of length == 1 or length == length(x).
+ * \param ppm parts-per-million tolerance (added to tolerance), length == 1.
+ * \param nomatch value that should be returned if a key couldn't be matched,
+ * has to be NA.
+ * \param nthreads number of threads to use.
+ * \param type type of the join, 1: outer, 2: left, 3: right, 4: inner,
+ * 5: all.
+ * \param values logical, report the values and their differences, too. The
+ * values are independent of the order and need no remapping.
+ */
+SEXP C_join_unsorted(SEXP x, SEXP y, SEXP tolerance, SEXP ppm,
+                     SEXP nomatch, SEXP nthreads, SEXP type, SEXP values) {
+    const R_xlen_t nx = XLENGTH(x), ntolerance = XLENGTH(tolerance);
+    R_xlen_t *ox = NULL, *oy = NULL;
+
+    if (ntolerance != 1 && ntolerance != nx)
+        error("'tolerance' has to be of length 1 or equal to 'length(x)'");
+
+    SEXP xs = PROTECT(sort_double(x, &ox));
+    SEXP ys = PROTECT(TYPEOF(y) == EXTPTRSXP ? y : sort_double(y, &oy));
+
+    if (isNull(xs) || isNull(ys))
+        error("'x' and 'y' must not contain NA.");
+
+    SEXP tols = tolerance;
+    if (ox && ntolerance > 1) {
+        double *ptol = REAL(tolerance);
+        tols = allocVector(REALSXP, nx);
+        double *ptols = REAL(tols);
+        for (R_xlen_t i = 0; i < nx; ++i)
+            ptols[i] = ptol[ox[i]];
+    }
+    PROTECT(tols);
+
+    SEXP check = PROTECT(ScalarLogical(FALSE));
+    SEXP out;
+
+    switch (asInteger(type)) {
+    case 2:
+        out = C_join_left(xs, ys, tols, ppm, nomatch, nthreads, check,
+                          values);
+        break;
+    case 3:
+        out = C_join_right(xs, ys, tols, ppm, nomatch, nthreads, check,
+                           values);
+        break;
+    case 4:
+        out = C_join_inner(xs, ys, tols, ppm, nomatch, nthreads, check,
+                           values);
+        break;
+    case 5:
+        out = C_join_all(xs, ys, tols, ppm, check, values);
+        break;
+    default:
+        out = C_join_outer(xs, ys, tols, ppm, nomatch, check, values);
+    }
+    PROTECT(out);
+
+    unsort_index(VECTOR_ELT(out, 0), ox);
+    unsort_index(VECTOR_ELT(out, 1), oy);
+
+    UNPROTECT(5);
+    return out;
+}
@@ -0,0 +1,222 @@
+#include "MsCoreUtils.h"
+
+#include <R.h>
+#include <Rinternals.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/* hit of a library search */
+typedef struct {
+    double score;
+    R_xlen_t library;   /* 0-based index of the library spectrum */
+} hit;
+
+/* lower score or, for ties, larger library index */
+static inline int worse(const hit *a, const hit *b) {
+    return a->score < b->score ||
+        (a->score == b->score && a->library > b->library);
+}
+
+static inline void swap_hits(hit *a, hit *b) {
+    hit tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+static void sift_down(hit *heap, int n, int i) {
+    for (;;) {
+        int l = 2 * i + 1, r = l + 1, w = i;
+
+        if (l < n && worse(&heap[l], &heap[w]))
+            w = l;
+        if (r < n && worse(&heap[r], &heap[w]))
+            w = r;
+        if (w == i)
+            return;
+        swap_hits(&heap[i], &heap[w]);
+        i = w;
+    }
+}
+
+static void sift_up(hit *heap, int i) {
+    while (i > 0) {
+        int p = (i - 1) / 2;
+
+        if (!worse(&heap[i], &heap[p]))
+            return;
+        swap_hits(&heap[i], &heap[p]);
+        i = p;
+    }
+}
+
+/**
+ * Add a hit to a heap of at most k hits.
+ *
+ * The heap is a min-heap, the worst hit is at the root and is replaced if a
+ * better hit is found after the heap is full.
+ *
+ * \param heap heap, length k.
+ * \param n current number of hits in the heap.
+ * \param k maximal number of hits.
+ * \param h new hit.
+ * \return new number of hits in the heap.
+ */
+static int heap_push(hit *heap, int n, int k, hit h) {
+    if (n < k) {
+        heap[n] = h;
+        sift_up(heap, n);
+        return n + 1;
+    }
+    if (worse(&heap[0], &h)) {
+        heap[0] = h;
+        sift_down(heap, n, 0);
+    }
+    return n;
+}
+
+/**
+ * Sort the hits of a heap, best hit first (heap sort).
+ */
+static void heap_sort(hit *heap, int n) {
+    for (int e = n - 1; e > 0; --e) {
+        swap_hits(&heap[0], &heap[e]);
+        sift_down(heap, e, 0);
+    }
+}
+
+/**
+ * Search a spectral library.
+ *
+ * For each query spectrum the library spectra with a precursor m/z within
+ * the precursor tolerance are found by a binary search in the sorted library
+ * precursor m/z values. Just these candidates are scored (see
+ * pair_similarity) and the k best hits are kept in a bounded heap.
+ *
+ * \param query list of peak matrices of the query spectra.
+ * \param library list of peak matrices of the library spectra.
+ * \param qprecursor precursor m/z of the query spectra.
+ * \param lprecursor precursor m/z of the library spectra, has to be sorted
+ * increasingly and must not contain any NA.
+ * \param fun similarity function, see similarity_fun_of.
+ * \param tolerance allowed absolute tolerance to match peaks, length == 1.
+ * \param ppm parts-per-million tolerance to match peaks, length == 1.
+ * \param ptolerance allowed absolute tolerance of the precursor m/z,
+ * length == 1.
+ * \param pppm parts-per-million tolerance of the precursor m/z, length == 1.
+ * \param k number of hits reported for each query.
+ * \param m weighting of the m/z values.
+ * \param n weighting of the intensity values.
+ * \param narm logical, should NA be removed?
+ * \param nthreads number of threads to use, the queries are processed in
+ * parallel.
+ * \return list with the index of the query, the library spectrum and the
+ * score of the hits, ordered by query and decreasing score.
+ */
+SEXP C_library_search(SEXP query, SEXP library, SEXP qprecursor,
+                      SEXP lprecursor, SEXP fun, SEXP tolerance, SEXP ppm,
+                      SEXP ptolerance, SEXP pppm, SEXP k, SEXP m, SEXP n,
+                      SEXP narm, SEXP nthreads) {
+    const R_xlen_t nq = XLENGTH(query), nl = XLENGTH(library);
+    const double *pqp = REAL(qprecursor), *plp = REAL(lprecursor);
+
+    if (XLENGTH(qprecursor) != nq || XLENGTH(lprecursor) != nl)
+        error("the length of the precursor m/z values has to match the "
+              "number of spectra");
+    if (!is_sorted(plp, nl))
+        error("'libraryPrecursorMz' has to be sorted non-decreasingly and "
+              "must not contain NA.");
+
+    const similarity_fun f = similarity_fun_of(fun);
+    const double *ptol = REAL(tolerance), *pptol = REAL(ptolerance);
+    const double dppm = asReal(ppm), dpppm = asReal(pppm);
+    const double dm = asReal(m), dn = asReal(n);
+    const int inarm = asLogical(narm) == TRUE;
+    int ik = asInteger(k);
+
+    if (!(ptol[0] >= 0) || !(dppm >= 0) || !(pptol[0] >= 0) || !(dpppm >= 0))
+        error("'tolerance', 'ppm', 'precursorTolerance' and 'precursorPpm' "
+              "have to be larger or equal zero.");
+    if (ik < 1)
+        error("'k' has to be larger than zero");
+    /* there are at most nl hits per query */
+    if (ik > nl)
+        ik = (int)nl;
+
+    const spectra q = prepare_spectra(query, "query");
+    PROTECT(q.protect);
+    const spectra l = prepare_spectra(library, "library");
+    PROTECT(l.protect);
+
+    int nth = asInteger(nthreads);
+#ifdef _OPENMP
+    if (nth < 1 || nq < 2)
+        nth = 1;
+#else
+    nth = 1;
+#endif
+
+    pair_buffer *buf = alloc_pair_buffers(nth, (R_xlen_t)q.maxpeaks +
+                                          l.maxpeaks);
+    hit *hits = (hit*) R_alloc(nq * ik, sizeof(hit));
+    int *nhits = (int*) R_alloc(nq, sizeof(int));
+
+#ifdef _OPENMP
+    #pragma omp parallel for num_threads(nth) schedule(dynamic)
+#endif
+    for (R_xlen_t i = 0; i < nq; ++i) {
+        int t = 0;
+#ifdef _OPENMP
+        t = omp_get_thread_num();
+#endif
+        hit *heap = hits + i * ik;
+        int nh = 0;
+
+        if (!ISNAN(pqp[i])) {
+            const double tol = tolerance_at(pptol, 1, 0, pqp[i], dpppm);
+
+            for (R_xlen_t j = gallop(plp, 0, nl, pqp[i] - tol);
+                    j < nl && plp[j] - pqp[i] <= tol; ++j) {
+                hit h = {pair_similarity(f, q.peaks[i], q.npeaks[i],
+                                         l.peaks[j], l.npeaks[j], &buf[t],
+                                         ptol, dppm, dm, dn, inarm), j};
+                if (!ISNAN(h.score))
+                    nh = heap_push(heap, nh, ik, h);
+            }
+        }
+        heap_sort(heap, nh);
+        nhits[i] = nh;
+    }
+
+    R_xlen_t total = 0;
+    for (R_xlen_t i = 0; i < nq; ++i)
+        total += nhits[i];
+
+    SEXP rq = PROTECT(alloc_index(total, nq));
+    SEXP rl = PROTECT(alloc_index(total, nl));
+    SEXP rs = PROTECT(allocVector(REALSXP, total));
+    index_ptr pq = index_ptr_of(rq), pl = index_ptr_of(rl);
+    double *ps = REAL(rs);
+
+    for (R_xlen_t i = 0, o = 0; i < nq; ++i) {
+        for (int h = 0; h < nhits[i]; ++h, ++o) {
+            index_set(pq, o, i + 1);
+            index_set(pl, o, hits[i * ik + h].library + 1);
+            ps[o] = hits[i * ik + h].score;
+        }
+    }
+
+    SEXP out = PROTECT(allocVector(VECSXP, 3));
+    SEXP nms = PROTECT(allocVector(STRSXP, 3));
+    SET_VECTOR_ELT(out, 0, rq);
+    SET_VECTOR_ELT(out, 1, rl);
+    SET_VECTOR_ELT(out, 2, rs);
+    SET_STRING_ELT(nms, 0, mkChar("query"));
+    SET_STRING_ELT(nms, 1, mkChar("library"));
+    SET_STRING_ELT(nms, 2, mkChar("score"));
+    setAttrib(out, R_NamesSymbol, nms);
+
+    UNPROTECT(7);
+    return out;
+}
@@ -9,52 +9,247 @@
 #include <R.h>
 #include <Rinternals.h>
 
-R_xlen_t windowMaxIdx(double* x, R_xlen_t start, R_xlen_t end) {
-  R_xlen_t i, m=start;
-  for (i=start+1; i<=end; ++i) {
-    if (x[m] < x[i]) {
-      m=i;
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/* y padded with q zeros on both sides */
+static inline double padded(const double* y, R_xlen_t n, R_xlen_t q,
+                            R_xlen_t i) {
+  return (i < q || i >= n+q) ? 0 : y[i-q];
+}
+
+/* size of the deque ring buffer: at most the whole window but never more than
+ * n elements of y and one padding zero on each side (see local_maxima) */
+static inline R_xlen_t deque_size(R_xlen_t n, R_xlen_t q) {
+  return 2*q+1 < n+2 ? 2*q+1 : n+2;
+}
+
+/* growing buffer of indices, the memory is allocated by R_alloc and not
+ * thread-safe */
+typedef struct {
+  R_xlen_t* i;
+  R_xlen_t size;
+} index_buffer;
+
+static inline void index_buffer_push(index_buffer* b, R_xlen_t k,
+                                     R_xlen_t value) {
+  if (k == b->size) {
+    R_xlen_t* i=(R_xlen_t*) R_alloc(2*b->size, sizeof(R_xlen_t));
+    memcpy(i, b->i, b->size*sizeof(R_xlen_t));
+    b->i=i;
+    b->size*=2;
+  }
+  b->i[k]=value;
+}
+
+/* Find local maxima using a monotonic deque (sliding window maximum).
+ *
+ * The deque holds the indices of the current window with non-increasing
+ * values, the front is the (leftmost) maximum of the window. Each index is
+ * pushed and popped at most once, so the costs are O(n) independent of the
+ * window size and the shape of the data.
+ * y is treated as if it is padded with q zeros on both sides. Just one
+ * padding zero per side is kept in the deque: the last one on the left (the
+ * earlier ones leave the window first and are never reported) and the first
+ * one on the right (it never leaves the window).
+ *
+ * NA/NaN are never pushed (they can't be compared). The maximum m is tracked
+ * like the former linear scan did: a NA/NaN becomes the maximum if it is the
+ * first value of the window when the previous maximum drops out of the
+ * window and blocks all other values until it drops out itself.
+ *
+ * y = array of double values
+ * n = length of y
+ * q = half window size
+ * deque = ring buffer of length deque_size(n, q)
+ * flags = array of n int, set to 1 for each local maximum, could be NULL
+ * buf = growing buffer for the 1-based indices, could be NULL
+ * returns the number of local maxima
+ */
+static R_xlen_t local_maxima(const double* y, R_xlen_t n, R_xlen_t q,
+                             R_xlen_t* deque, int* flags,
+                             index_buffer* buf) {
+  R_xlen_t i, windowSize=q*2, size=deque_size(n, q), head=0, count=0, nmax=0;
+  R_xlen_t m=0, l;
+
+  for (i=0; i<n+windowSize; ++i) {
+    const double yi=padded(y, n, q, i);
+    l=i-windowSize;
+
+    /* maximum out of window */
+    if (count && deque[head] < l) {
+      head=(head+1)%size;
+      --count;
+    }
+
+    /* remove smaller values from the back, equal values are kept to report
+     * the leftmost maximum (except for the left padding) */
+    if (!ISNAN(yi) &&
+        !(i >= n+q && count && deque[(head+count-1)%size] >= n+q)) {
+      while (count &&
+             (i < q || padded(y, n, q, deque[(head+count-1)%size]) < yi)) {
+        --count;
+      }
+      deque[(head+count)%size]=i;
+      ++count;
+    }
+
+    if (l < 0) {
+      continue;
+    }
+
+    /* first window or maximum out of window: the first NA/NaN of the window
+     * or the front of the deque; a NA/NaN maximum is kept */
+    if (l == 0 || m < l) {
+      m=ISNAN(padded(y, n, q, l)) ? l : deque[head];
+    } else if (!ISNAN(padded(y, n, q, m))) {
+      m=deque[head];
+    }
+
+    /* window complete, is the middle (i - q in padded y) the maximum? */
+    if (m == i-q) {
+      if (flags) {
+        flags[i-windowSize]=1;
+      }
+      if (buf) {
+        index_buffer_push(buf, nmax, i-windowSize+1);
+      }
+      ++nmax;
     }
   }
-  return(m);
+  return(nmax);
 }
 
 /* y = array of double values
  * s = half window size
+ * index = logical, return the 1-based indices of the local maxima instead of
+ * a logical vector of the same length as y; the indices are collected in a
+ * single pass into a small growing buffer
  */
-SEXP C_localMaxima(SEXP y, SEXP s) {
+SEXP C_localMaxima(SEXP y, SEXP s, SEXP index) {
   SEXP output;
-  R_xlen_t n, q, m, windowSize, i, l, mid;
+  R_xlen_t n, q;
+
+  /* NA_INTEGER is negative too */
+  q=asInteger(s);
+  if (q < 0)
+    error("'hws' has to be larger or equal zero");
 
   PROTECT(y=coerceVector(y, REALSXP));
   n=XLENGTH(y);
 
-  PROTECT(output=allocVector(LGLSXP, n));
-
   double* xy=REAL(y);
-  int* xo=LOGICAL(output);
-  memset(xo, 0, n*sizeof(int));
+  R_xlen_t* deque=(R_xlen_t*) R_alloc(deque_size(n, q), sizeof(R_xlen_t));
 
-  q=asInteger(s);
-  windowSize=q*2;
-  m=windowMaxIdx(xy, 0, windowSize);
-
-  xo[m]=m==q;
+  if (asLogical(index) == TRUE) {
+    index_buffer buf={(R_xlen_t*) R_alloc(256, sizeof(R_xlen_t)), 256};
+    R_xlen_t nmax=local_maxima(xy, n, q, deque, NULL, &buf);
 
-  /* i == rhs; l == lhs; mid == middle pos */
-  for (i=windowSize+1, l=i-windowSize, mid=(l+i)/2; i<n; ++i, ++mid, ++l) {
-    /* maximum out of window, calculate new maximum in current window */
-    if (m < l) {
-      m=windowMaxIdx(xy, l, i);
-    } else if (xy[i] > xy[m]) {
-      m=i;
+    PROTECT(output=alloc_index(nmax, n));
+    index_ptr po=index_ptr_of(output);
+    for (R_xlen_t i=0; i<nmax; ++i) {
+      index_set(po, i, buf.i[i]);
     }
+  } else {
+    PROTECT(output=allocVector(LGLSXP, n));
 
-    if (m == mid) {
-      xo[m]=1;
-    }
+    int* xo=LOGICAL(output);
+    memset(xo, 0, n*sizeof(int));
+
+    local_maxima(xy, n, q, deque, xo, NULL);
   }
 
   UNPROTECT(2);
   return(output);
 }
+
+/**
+ * Find local maxima in multiple spectra.
+ *
+ * The spectra are processed in parallel, the indices of each spectrum are
+ * collected in its own part of a shared buffer and copied into exactly
+ * allocated vectors afterwards. Two local maxima are more than hws apart
+ * (the leftmost maximum of a window is reported), so a spectrum of length n
+ * has at most n / (hws + 1) + 1 local maxima.
+ *
+ * \param x list of double vectors or a double matrix (one spectrum per
+ * column).
+ * \param s half window size.
+ * \param nthreads number of threads to use.
+ * \return list of 1-based indices of the local maxima for each spectrum.
+ */
+SEXP C_local_maxima_list(SEXP x, SEXP s, SEXP nthreads) {
+  const int ismatrix=isMatrix(x);
+  const R_xlen_t ns=ismatrix ? ncols(x) : XLENGTH(x);
+  const R_xlen_t q=asInteger(s);
+
+  /* NA_INTEGER is negative too */
+  if (q < 0)
+    error("'hws' has to be larger or equal zero");
+  if (TYPEOF(x) != (ismatrix ? REALSXP : VECSXP))
+    error("'x' has to be a 'list' of 'double' vectors or a 'double' matrix");
+
+  const double** py=(const double**) R_alloc(ns, sizeof(double*));
+  R_xlen_t* ny=(R_xlen_t*) R_alloc(ns, sizeof(R_xlen_t));
+  R_xlen_t* nmax=(R_xlen_t*) R_alloc(ns, sizeof(R_xlen_t));
+  R_xlen_t* offset=(R_xlen_t*) R_alloc(ns+1, sizeof(R_xlen_t));
+
+  for (R_xlen_t i=0; i<ns; ++i) {
+    if (ismatrix) {
+      ny[i]=nrows(x);
+      py[i]=REAL(x)+i*ny[i];
+    } else {
+      SEXP xi=VECTOR_ELT(x, i);
+      if (TYPEOF(xi) != REALSXP)
+        error("all elements of 'x' have to be of type 'double'");
+      ny[i]=XLENGTH(xi);
+      py[i]=REAL(xi);
+    }
+  }
+
+  R_xlen_t dsize=0;
+  offset[0]=0;
+  for (R_xlen_t i=0; i<ns; ++i) {
+    offset[i+1]=offset[i]+ny[i]/(q+1)+1;
+    if (dsize < deque_size(ny[i], q)) {
+      dsize=deque_size(ny[i], q);
+    }
+  }
+  R_xlen_t* indices=(R_xlen_t*) R_alloc(offset[ns], sizeof(R_xlen_t));
+
+  int nth=asInteger(nthreads);
+#ifdef _OPENMP
+  if (nth < 1 || ns < 2)
+    nth=1;
+#else
+  nth=1;
+#endif
+  R_xlen_t* deques=(R_xlen_t*) R_alloc(nth*dsize, sizeof(R_xlen_t));
+
+#ifdef _OPENMP
+  #pragma omp parallel for num_threads(nth) schedule(dynamic)
+#endif
+  for (R_xlen_t i=0; i<ns; ++i) {
+    int t=0;
+#ifdef _OPENMP
+    t=omp_get_thread_num();
+#endif
+    /* never grows (see above), no R_alloc in the threads */
+    index_buffer buf={indices+offset[i], offset[i+1]-offset[i]};
+    nmax[i]=local_maxima(py[i], ny[i], q, deques+t*dsize, NULL, &buf);
+  }
+
+  SEXP out=PROTECT(allocVector(VECSXP, ns));
+
+  for (R_xlen_t i=0; i<ns; ++i) {
+    SET_VECTOR_ELT(out, i, alloc_index(nmax[i], ny[i]));
+    index_ptr po=index_ptr_of(VECTOR_ELT(out, i));
+    for (R_xlen_t k=0; k<nmax[i]; ++k) {
+      index_set(po, k, indices[offset[i]+k]);
+    }
+  }
+
+  UNPROTECT(1);
+  return(out);
+}
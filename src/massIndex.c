@@ -0,0 +1,191 @@
+#include "MsCoreUtils.h"
+
+#include <R.h>
+#include <Rinternals.h>
+#include <math.h>
+
+/* default average number of table elements per bucket */
+#define BUCKET_SIZE 4
+
+/* maximal number of buckets per table element */
+#define MAX_BUCKETS_PER_ELEMENT 64
+
+/**
+ * Bucket of a value.
+ *
+ * The same (monotone) formula is used for building the index and for the
+ * lookup. Hence all elements in buckets below the bucket of value are smaller
+ * and all elements in buckets above are larger than value.
+ */
+static inline R_xlen_t bucket_of(const mass_index *idx, double value) {
+    R_xlen_t b = (R_xlen_t)((value - idx->min) / idx->width);
+    return b < idx->nbuckets ? b : idx->nbuckets - 1;
+}
+
+static void mass_index_finalize(SEXP ptr) {
+    mass_index *idx = (mass_index*) R_ExternalPtrAddr(ptr);
+
+    if (idx) {
+        R_Free(idx->first);
+        R_Free(idx);
+        R_ClearExternalPtr(ptr);
+    }
+}
+
+/**
+ * Build the bucket index for a sorted table.
+ *
+ * The index is attached to ptr as soon as it is allocated, so it is freed by
+ * the finalizer of ptr even if a later allocation fails.
+ *
+ * \param ptr external pointer (protected, with mass_index_finalize as
+ * finalizer) the index is attached to.
+ * \param ptable table, has to be sorted increasingly and must not contain NA.
+ * \param n length of ptable.
+ * \param width bucket width, chosen automatically if NA or not positive.
+ * \return pointer to the new index.
+ */
+static mass_index* mass_index_build(SEXP ptr, const double *ptable,
+                                    R_xlen_t n, double width) {
+    double range = n ? ptable[n - 1] - ptable[0] : 0;
+
+    if (ISNAN(width) || width <= 0) {
+        R_xlen_t nb = n / BUCKET_SIZE;
+        width = range > 0 ? range / (nb > 1 ? nb : 1) : 1;
+    }
+
+    double nb = floor(range / width) + 1;
+    if (nb > (double)n * MAX_BUCKETS_PER_ELEMENT + 1)
+        error("'bucketWidth' is too small for the range of 'x'");
+
+    mass_index *idx = R_Calloc(1, mass_index);
+    R_SetExternalPtrAddr(ptr, idx);
+    idx->n = n;
+    idx->nbuckets = (R_xlen_t)nb;
+    idx->min = n ? ptable[0] : 0;
+    idx->width = width;
+    idx->first = R_Calloc(idx->nbuckets + 1, R_xlen_t);
+
+    idx->firstdup = n;
+    for (R_xlen_t i = 1; i < n; ++i) {
+        if (ptable[i - 1] == ptable[i]) {
+            idx->firstdup = i - 1;
+            break;
+        }
+    }
+
+    R_xlen_t b = 0;
+    for (R_xlen_t i = 0; i < n; ++i) {
+        R_xlen_t bi = bucket_of(idx, ptable[i]);
+        while (b <= bi)
+            idx->first[b++] = i;
+    }
+    while (b <= idx->nbuckets)
+        idx->first[b++] = n;
+
+    return idx;
+}
+
+/**
+ * Get the index of an external pointer created by C_mass_index.
+ *
+ * External pointers are not serialized. If the object was saved and
+ * restored the index is rebuilt from the table and the bucket width that are
+ * stored alongside.
+ */
+static const mass_index* mass_index_get(SEXP ptr) {
+    if (TYPEOF(ptr) != EXTPTRSXP)
+        error("'table' is not a valid 'massIndex'");
+
+    mass_index *idx = (mass_index*) R_ExternalPtrAddr(ptr);
+
+    if (!idx) {
+        SEXP table = R_ExternalPtrProtected(ptr);
+        R_RegisterCFinalizerEx(ptr, mass_index_finalize, TRUE);
+        idx = mass_index_build(ptr, REAL(table), XLENGTH(table),
+                               asReal(R_ExternalPtrTag(ptr)));
+    }
+    return idx;
+}
+
+/**
+ * Resolve a table that might be a mass index.
+ *
+ * \param table pointer to a numeric vector or a massIndex external pointer.
+ * In the latter case it is replaced by the indexed table.
+ * \return the index or NULL if table is a plain vector.
+ */
+const mass_index* mass_index_resolve(SEXP *table) {
+    if (TYPEOF(*table) != EXTPTRSXP)
+        return NULL;
+
+    const mass_index *idx = mass_index_get(*table);
+    *table = R_ExternalPtrProtected(*table);
+    return idx;
+}
+
+/**
+ * Length of a table that might be a mass index.
+ */
+R_xlen_t table_length(SEXP table) {
+    if (TYPEOF(table) == EXTPTRSXP)
+        table = R_ExternalPtrProtected(table);
+    return XLENGTH(table);
+}
+
+/**
+ * Find the first element in an indexed table that is not smaller than value.
+ *
+ * The bucket of value limits the search to the few elements within this
+ * bucket.
+ *
+ * \param idx index.
+ * \param ptable indexed table.
+ * \param value value to look for.
+ * \return index (0-based) of the first element >= value or idx->n if there
+ * is none.
+ */
+R_xlen_t mass_index_lookup(const mass_index *idx, const double *ptable,
+                           double value) {
+    if (!idx->n || !(value > idx->min))
+        return 0;
+    if (!(value <= ptable[idx->n - 1]))
+        return idx->n;
+
+    R_xlen_t b = bucket_of(idx, value);
+    return gallop(ptable, idx->first[b], idx->first[b + 1], value);
+}
+
+/**
+ * Create a mass index.
+ *
+ * \param table numeric (double) table, has to be sorted increasingly and must
+ * not contain any NA.
+ * \param width bucket width, NA to choose it automatically.
+ * \return external pointer to the index, the table is kept alive as the
+ * protected value and the bucket width as the tag of the pointer.
+ */
+SEXP C_mass_index(SEXP table, SEXP width) {
+    /* the finalizer frees the index if anything below fails */
+    SEXP ptr = PROTECT(R_MakeExternalPtr(NULL, R_NilValue, table));
+    R_RegisterCFinalizerEx(ptr, mass_index_finalize, TRUE);
+
+    const mass_index *idx =
+        mass_index_build(ptr, REAL(table), XLENGTH(table), asReal(width));
+    R_SetExternalPtrTag(ptr, ScalarReal(idx->width));
+
+    UNPROTECT(1);
+    return ptr;
+}
+
+/**
+ * Get the indexed table of a mass index.
+ *
+ * \param index external pointer created by C_mass_index.
+ * \return the numeric table.
+ */
+SEXP C_mass_index_table(SEXP index) {
+    if (TYPEOF(index) != EXTPTRSXP)
+        error("'x' is not a valid 'massIndex'");
+    return R_ExternalPtrProtected(index);
+}
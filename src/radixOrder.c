@@ -0,0 +1,118 @@
+#include "MsCoreUtils.h"
+
+#include <R.h>
+#include <Rinternals.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Map a double to an unsigned integer with the same order.
+ *
+ * Positive numbers just need the sign bit to be set, for negative numbers all
+ * bits are flipped to reverse their order.
+ */
+static inline uint64_t double_key(double x) {
+    uint64_t u;
+
+    /* -0.0 and 0.0 should be equal */
+    if (x == 0)
+        x = 0;
+    memcpy(&u, &x, sizeof(u));
+    return (u >> 63) ? ~u : u | ((uint64_t)1 << 63);
+}
+
+/**
+ * Stable order of a double array.
+ *
+ * LSD radix sort on the bit pattern of the doubles using 8 passes of 8 bits.
+ * The histograms of all passes are created in a single loop and passes in
+ * which all elements share the same byte (e.g. the exponent of values of
+ * similar magnitude) are skipped.
+ *
+ * \param x array.
+ * \param n length of x.
+ * \param order output, 0-based indices of the elements of x in increasing
+ * order, ties keep their original order (like order()).
+ * \return 1 if x contains NA/NaN (order is undefined in this case), 0
+ * otherwise.
+ */
+int radix_order(const double *x, R_xlen_t n, R_xlen_t *order) {
+    uint64_t *key = (uint64_t*) R_alloc(n, sizeof(uint64_t));
+    uint64_t *key2 = (uint64_t*) R_alloc(n, sizeof(uint64_t));
+    R_xlen_t *order2 = (R_xlen_t*) R_alloc(n, sizeof(R_xlen_t));
+    R_xlen_t *o = order, *tmp;
+    uint64_t *tmpk;
+    R_xlen_t count[8][256];
+
+    memset(count, 0, sizeof(count));
+
+    for (R_xlen_t i = 0; i < n; ++i) {
+        if (ISNAN(x[i]))
+            return 1;
+        key[i] = double_key(x[i]);
+        o[i] = i;
+        for (int b = 0; b < 8; ++b)
+            ++count[b][(key[i] >> (b * 8)) & 0xff];
+    }
+
+    for (int b = 0; b < 8; ++b) {
+        const int shift = b * 8;
+
+        /* all elements have the same byte */
+        if (!n || count[b][(key[0] >> shift) & 0xff] == n)
+            continue;
+
+        R_xlen_t pos = 0;
+        for (int d = 0; d < 256; ++d) {
+            R_xlen_t c = count[b][d];
+            count[b][d] = pos;
+            pos += c;
+        }
+        for (R_xlen_t i = 0; i < n; ++i) {
+            R_xlen_t p = count[b][(key[i] >> shift) & 0xff]++;
+            key2[p] = key[i];
+            order2[p] = o[i];
+        }
+        tmpk = key;
+        key = key2;
+        key2 = tmpk;
+        tmp = o;
+        o = order2;
+        order2 = tmp;
+    }
+
+    if (o != order)
+        memcpy(order, o, n * sizeof(R_xlen_t));
+    return 0;
+}
+
+/**
+ * Sort a numeric (double) vector.
+ *
+ * \param x numeric vector.
+ * \param order output, set to NULL if x is already sorted or to the
+ * 0-based order (allocated by R_alloc) otherwise.
+ * \return x if it is already sorted, a sorted copy (unprotected) of x or
+ * R_NilValue if x contains NA.
+ */
+SEXP sort_double(SEXP x, R_xlen_t **order) {
+    const double *px = REAL(x);
+    const R_xlen_t n = XLENGTH(x);
+
+    *order = NULL;
+
+    if (is_sorted(px, n))
+        return x;
+
+    R_xlen_t *o = (R_xlen_t*) R_alloc(n, sizeof(R_xlen_t));
+    if (radix_order(px, n, o))
+        return R_NilValue;
+
+    SEXP out = allocVector(REALSXP, n);
+    double *pout = REAL(out);
+    for (R_xlen_t i = 0; i < n; ++i)
+        pout[i] = px[o[i]];
+
+    *order = o;
+    return out;
+}
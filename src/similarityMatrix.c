@@ -0,0 +1,213 @@
+#include "MsCoreUtils.h"
+
+#include <R.h>
+#include <Rinternals.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/**
+ * Similarity function of the R argument FUN.
+ *
+ * \param fun 1: ndotproduct, 2: neuclidean, 3: navdist, 4: nspectraangle.
+ */
+similarity_fun similarity_fun_of(SEXP fun) {
+    static const similarity_fun funs[] = {
+        ndotproduct, neuclidean, navdist, nspectraangle
+    };
+    const int ifun = asInteger(fun);
+
+    if (ifun < 1 || ifun > 4)
+        error("unknown similarity function");
+    return funs[ifun - 1];
+}
+
+/**
+ * Coerce a list of peak matrices to double and test the m/z values.
+ *
+ * \param x list of peak matrices (m/z, intensity).
+ * \param name name of x used in the error messages.
+ * \return spectra, the coerced matrices are kept alive in s.protect (has to be
+ * protected by the caller).
+ */
+spectra prepare_spectra(SEXP x, const char *name) {
+    const R_xlen_t ns = XLENGTH(x);
+    spectra s;
+
+    s.protect = PROTECT(allocVector(VECSXP, ns));
+    s.peaks = (const double**) R_alloc(ns, sizeof(double*));
+    s.npeaks = (int*) R_alloc(ns, sizeof(int));
+    s.maxpeaks = 0;
+
+    for (R_xlen_t i = 0; i < ns; ++i) {
+        SEXP xi = VECTOR_ELT(x, i);
+        if (!isMatrix(xi) || ncols(xi) < 2)
+            error("all elements of '%s' have to be matrices with two columns",
+                  name);
+        SET_VECTOR_ELT(s.protect, i, xi = coerceVector(xi, REALSXP));
+        s.peaks[i] = REAL(xi);
+        s.npeaks[i] = nrows(xi);
+        if (!is_sorted(s.peaks[i], s.npeaks[i]))
+            error("the m/z values of all elements of '%s' have to be sorted "
+                  "non-decreasingly and must not contain NA.", name);
+        if (s.npeaks[i] > s.maxpeaks)
+            s.maxpeaks = s.npeaks[i];
+    }
+
+    UNPROTECT(1);
+    return s;
+}
+
+/**
+ * Allocate the buffers for nthreads threads.
+ *
+ * \param nthreads number of threads.
+ * \param maxrows maximal number of rows of an outer join.
+ */
+pair_buffer* alloc_pair_buffers(int nthreads, R_xlen_t maxrows) {
+    const size_t nbuf = (size_t)maxrows + 1;
+    pair_buffer *buf = (pair_buffer*) R_alloc(nthreads, sizeof(pair_buffer));
+
+    for (int t = 0; t < nthreads; ++t) {
+        buf[t].rx = (int*) R_alloc(2 * nbuf, sizeof(int));
+        buf[t].ry = buf[t].rx + nbuf;
+        buf[t].xmz = (double*) R_alloc(4 * nbuf, sizeof(double));
+        buf[t].xint = buf[t].xmz + nbuf;
+        buf[t].ymz = buf[t].xint + nbuf;
+        buf[t].yint = buf[t].ymz + nbuf;
+    }
+    return buf;
+}
+
+/**
+ * Similarity of two spectra.
+ *
+ * The peaks are matched by an outer join (like join(type = "outer")) and the
+ * similarity is calculated for the matched peaks. Unmatched peaks are NA
+ * (like x[NA, ]) in the other spectrum. Doesn't use the R API and could be
+ * called from multiple threads.
+ *
+ * \param x, y peak matrices (m/z values followed by the intensities).
+ * \param nx, ny number of peaks.
+ * \param b buffers.
+ * \return similarity.
+ */
+double pair_similarity(similarity_fun fun, const double *x, int nx,
+                       const double *y, int ny, const pair_buffer *b,
+                       const double *ptolerance, double ppm,
+                       double m, double n, int narm) {
+    const index_ptr prx = {b->rx, NULL}, pry = {b->ry, NULL};
+    const join_values v = {NULL, NULL, NULL, NULL};
+
+    const R_xlen_t nr = join_outer(x, nx, y, ny, ptolerance, 1, ppm,
+                                   NA_INTEGER, 0, 0, prx, pry, &v);
+
+    for (R_xlen_t k = 0; k < nr; ++k) {
+        const int ix = b->rx[k], iy = b->ry[k];
+        if (ix == NA_INTEGER) {
+            b->xmz[k] = b->xint[k] = NA_REAL;
+        } else {
+            b->xmz[k] = x[ix - 1];
+            b->xint[k] = x[nx + ix - 1];
+        }
+        if (iy == NA_INTEGER) {
+            b->ymz[k] = b->yint[k] = NA_REAL;
+        } else {
+            b->ymz[k] = y[iy - 1];
+            b->yint[k] = y[ny + iy - 1];
+        }
+    }
+    return fun(b->xmz, b->xint, b->ymz, b->yint, nr, m, n, narm);
+}
+
+/**
+ * Pairwise similarity of spectra.
+ *
+ * For symmetric similarity functions (ndotproduct, nspectraangle) just the
+ * upper triangle (including the diagonal) is calculated, x[[i]] is used as x
+ * and x[[j]] as y for i <= j. It is mirrored just for ppm == 0, otherwise the
+ * tolerance depends on the m/z of the first spectrum and the outer join of
+ * (x, y) could differ from (y, x).
+ *
+ * \param x list of peak matrices (m/z, intensity), the m/z values have to be
+ * sorted increasingly and must not contain NA.
+ * \param fun similarity function, 1: ndotproduct, 2: neuclidean,
+ * 3: navdist, 4: nspectraangle.
+ * \param tolerance allowed absolute tolerance to match peaks, length == 1.
+ * \param ppm parts-per-million tolerance (added to tolerance), length == 1.
+ * \param m weighting of the m/z values.
+ * \param n weighting of the intensity values.
+ * \param narm logical, should NA be removed?
+ * \param packed logical, return the upper triangle (column-wise) as vector
+ * instead of a dense matrix, just supported for symmetric functions.
+ * \param nthreads number of threads to use.
+ * \return dense similarity matrix or packed upper triangle.
+ */
+SEXP C_similarity_matrix(SEXP x, SEXP fun, SEXP tolerance, SEXP ppm,
+                         SEXP m, SEXP n, SEXP narm, SEXP packed,
+                         SEXP nthreads) {
+    const R_xlen_t ns = XLENGTH(x);
+    const similarity_fun f = similarity_fun_of(fun);
+    const int symmetric = f == ndotproduct || f == nspectraangle;
+    const int ipacked = asLogical(packed) == TRUE;
+
+    if (ipacked && !symmetric)
+        error("'packed = TRUE' is just supported for symmetric similarity "
+              "functions");
+
+    const double *ptolerance = REAL(tolerance);
+    const double dppm = asReal(ppm), dm = asReal(m), dn = asReal(n);
+    const int inarm = asLogical(narm) == TRUE;
+
+    if (!(ptolerance[0] >= 0) || !(dppm >= 0))
+        error("'tolerance' and 'ppm' have to be larger or equal zero.");
+
+    /* just the upper triangle has to be calculated */
+    const int upper = ipacked || (symmetric && dppm == 0);
+
+    /* coerce to double and test the m/z values once */
+    const spectra s = prepare_spectra(x, "x");
+    PROTECT(s.protect);
+
+    SEXP out = PROTECT(ipacked ? allocVector(REALSXP, ns * (ns + 1) / 2) :
+                       allocMatrix(REALSXP, ns, ns));
+    double *pout = REAL(out);
+
+    int nth = asInteger(nthreads);
+#ifdef _OPENMP
+    if (nth < 1 || ns < 2)
+        nth = 1;
+#else
+    nth = 1;
+#endif
+
+    /* outer join of two spectra has at most 2 * maxpeaks rows */
+    pair_buffer *buf = alloc_pair_buffers(nth, 2 * (R_xlen_t)s.maxpeaks);
+
+#ifdef _OPENMP
+    #pragma omp parallel for num_threads(nth) schedule(dynamic)
+#endif
+    for (R_xlen_t j = 0; j < ns; ++j) {
+        int t = 0;
+#ifdef _OPENMP
+        t = omp_get_thread_num();
+#endif
+        for (R_xlen_t i = 0; i < (upper ? j + 1 : ns); ++i) {
+            const double sim = pair_similarity(f, s.peaks[i], s.npeaks[i],
+                                               s.peaks[j], s.npeaks[j],
+                                               &buf[t], ptolerance, dppm, dm,
+                                               dn, inarm);
+            if (ipacked) {
+                pout[j * (j + 1) / 2 + i] = sim;
+            } else {
+                pout[i + j * ns] = sim;
+                if (upper)
+                    pout[j + i * ns] = sim;
+            }
+        }
+    }
+
+    UNPROTECT(2);
+    return out;
+}
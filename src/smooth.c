@@ -0,0 +1,410 @@
+#include "MsCoreUtils.h"
+
+#include <R.h>
+#include <Rinternals.h>
+#include <math.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/* number of values filtered at once, the block of x and y stays in cache */
+#define FILTER_BLOCK 1024
+
+/* narrower windows are filtered value by value, the blockwise filter just
+ * pays off for wide windows */
+#define FILTER_BLOCK_MIN_WIDTH 16
+
+/* number of values after which the running sum is calculated from scratch to
+ * limit the accumulation of rounding errors */
+#define RUNNING_SUM_BLOCK 4096
+
+/**
+ * Filter the interior by arbitrary coefficients.
+ *
+ * For wide windows the filter is applied blockwise coefficient by coefficient,
+ * the inner loop over the values is a simple multiply-add on contiguous memory
+ * that could be vectorized (SIMD).
+ *
+ * \param x values to filter.
+ * \param n length of x.
+ * \param rc reversed centre row of the coefficient matrix.
+ * \param w window size.
+ * \param y output buffer, y[hws:(n - hws - 1)] are set.
+ */
+static void filter_general(const double *x, R_xlen_t n, const double *rc,
+                           int w, double *y) {
+    const int hws = w / 2;
+
+    if (w < FILTER_BLOCK_MIN_WIDTH) {
+        for (R_xlen_t i = hws; i < n - hws; ++i) {
+            const double *xi = x + i + hws - (w - 1);
+            double s = 0;
+
+            for (int j = 0; j < w; ++j)
+                s += rc[j] * xi[j];
+            y[i] = s;
+        }
+        return;
+    }
+
+    for (R_xlen_t b = hws; b < n - hws; b += FILTER_BLOCK) {
+        const R_xlen_t e = b + FILTER_BLOCK < n - hws ? b + FILTER_BLOCK :
+            n - hws;
+
+        for (R_xlen_t i = b; i < e; ++i)
+            y[i] = 0;
+        for (int j = 0; j < w; ++j) {
+            const double c = rc[j];
+            const R_xlen_t o = hws - (w - 1) + j;
+#ifdef _OPENMP
+            #pragma omp simd
+#endif
+            for (R_xlen_t i = b; i < e; ++i)
+                y[i] += c * x[i + o];
+        }
+    }
+}
+
+/**
+ * Filter the interior by symmetric coefficients.
+ *
+ * Like filter_general but the values with the same distance to the centre are
+ * added before multiplying, this halves the number of multiplications.
+ *
+ * \param c centre row of the coefficient matrix, c[j] == c[w - 1 - j],
+ * w has to be odd.
+ */
+static void filter_symmetric(const double *x, R_xlen_t n, const double *c,
+                             int w, double *y) {
+    const int hws = w / 2;
+
+    for (R_xlen_t b = hws; b < n - hws; b += FILTER_BLOCK) {
+        const R_xlen_t e = b + FILTER_BLOCK < n - hws ? b + FILTER_BLOCK :
+            n - hws;
+        const double ch = c[hws];
+
+#ifdef _OPENMP
+        #pragma omp simd
+#endif
+        for (R_xlen_t i = b; i < e; ++i)
+            y[i] = ch * x[i];
+        for (int j = 0; j < hws; ++j) {
+            const double cj = c[j];
+            const R_xlen_t d = hws - j;
+#ifdef _OPENMP
+            #pragma omp simd
+#endif
+            for (R_xlen_t i = b; i < e; ++i)
+                y[i] += cj * (x[i - d] + x[i + d]);
+        }
+    }
+}
+
+/**
+ * Filter the interior by constant coefficients (moving average).
+ *
+ * A running sum is used, the costs are O(n) independent of the window size.
+ * The sum is recalculated every RUNNING_SUM_BLOCK values. x must just contain
+ * finite values (NA/NaN/Inf would poison the running sum).
+ *
+ * \param c the coefficient, c = 1 / w for a moving average.
+ */
+static void filter_constant(const double *x, R_xlen_t n, double c, int w,
+                            double *y) {
+    const int hws = w / 2;
+    double s = 0;
+
+    /* window of y[i] is x[lo:(lo + w - 1)] */
+    for (R_xlen_t i = hws, lo = 2 * hws - (w - 1); i < n - hws; ++i, ++lo) {
+        if ((i - hws) % RUNNING_SUM_BLOCK == 0) {
+            s = 0;
+            for (int j = 0; j < w; ++j)
+                s += x[lo + j];
+        } else
+            s += x[lo + w - 1] - x[lo - 1];
+        y[i] = c * s;
+    }
+}
+
+/* are all values finite? */
+static int all_finite(const double *x, R_xlen_t n) {
+    for (R_xlen_t i = 0; i < n; ++i)
+        if (!R_FINITE(x[i]))
+            return 0;
+    return 1;
+}
+
+/* coefficient matrix and the filter chosen by its structure */
+typedef struct {
+    const double *cf;   /* coefficient matrix (w x w, column-major) */
+    double *rc;         /* reversed centre row, to iterate forward over x */
+    int w;              /* window size, usually w = 2 * hws + 1 */
+    int constant;       /* all coefficients of the centre row are equal */
+    int symmetric;      /* the centre row is symmetric */
+} smoother;
+
+/**
+ * Prepare a coefficient matrix for smooth_kernel.
+ *
+ * \param cf double, square coefficient matrix.
+ */
+static smoother smoother_of(SEXP cf) {
+    smoother s;
+
+    s.w = nrows(cf);
+    if (ncols(cf) != s.w)
+        error("'cf' has to be a square matrix");
+
+    const int hws = s.w / 2;
+    s.cf = REAL(cf);
+    s.rc = (double*) R_alloc(s.w, sizeof(double));
+    s.constant = 1;
+    s.symmetric = s.w % 2;
+
+    for (int j = 0; j < s.w; ++j) {
+        s.rc[j] = s.cf[hws + (s.w - 1 - j) * s.w];
+        s.constant &= s.rc[j] == s.rc[0];
+    }
+    for (int j = 0; j < hws; ++j)
+        s.symmetric &= s.rc[j] == s.rc[s.w - 1 - j];
+
+    return s;
+}
+
+/**
+ * Smooth a vector by a coefficient matrix.
+ *
+ * The interior is filtered by the centre row of cf, like
+ * stats::filter(x, cf[hws + 1, ], sides = 2), i.e. the coefficients are
+ * applied in reverse order and a window containing NA/NaN results in NA. The
+ * first (last) hws values are the products of the first (last) hws rows of
+ * cf and the first (last) w values of x.
+ *
+ * The filter is chosen by the structure of the centre row: a running sum for
+ * constant coefficients (coefMA), a filter using the symmetry for wide
+ * windows (coefWMA, coefSG) or a general filter.
+ *
+ * Doesn't use the R API and could be called from multiple threads.
+ *
+ * \param s coefficients, see smoother_of.
+ * \param x values to smooth.
+ * \param n length of x, has to be >= w.
+ * \param y output buffer of length n.
+ */
+static void smooth_kernel(const smoother *s, const double *x, R_xlen_t n,
+                          double *y) {
+    const double *cf = s->cf, *rc = s->rc;
+    const int w = s->w, hws = w / 2;
+
+    if (s->constant && all_finite(x, n))
+        filter_constant(x, n, rc[0], w, y);
+    else if (s->symmetric && w >= FILTER_BLOCK_MIN_WIDTH)
+        filter_symmetric(x, n, rc, w, y);
+    else
+        filter_general(x, n, rc, w, y);
+
+    /* a window containing NA/NaN results in NA (like stats::filter) */
+    for (R_xlen_t i = hws; i < n - hws; ++i) {
+        if (ISNAN(y[i])) {
+            const double *xi = x + i + hws - (w - 1);
+            for (int j = 0; j < w; ++j) {
+                if (ISNAN(xi[j])) {
+                    y[i] = NA_REAL;
+                    break;
+                }
+            }
+        }
+    }
+
+    /* left/right extrema, see sgolay in signal 0.7-3/R/sgolay.R */
+    const double *xr = x + n - w;
+    for (int r = 0; r < hws; ++r) {
+        const int rr = w - hws + r;
+        double sl = 0, sr = 0;
+
+        for (int j = 0; j < w; ++j) {
+            sl += cf[r + j * w] * x[j];
+            sr += cf[rr + j * w] * xr[j];
+        }
+        y[r] = sl;
+        y[n - hws + r] = sr;
+    }
+}
+
+/**
+ * Savitzky-Golay coefficients.
+ *
+ * Row i of the coefficient matrix are the weights of the least squares fit of
+ * a polynomial of order k to the w values evaluated at point i. They are
+ * calculated by a QR decomposition (modified Gram-Schmidt with
+ * reorthogonalization) of the Vandermonde matrix X (w x (k + 1)) instead of
+ * solving the normal equations (X'X)^-1 X'. With X = QR the value of the fit
+ * at point i is e1' R^-1 Q' y, so the weights are Q a with R' a = e1.
+ * The distances to point i are scaled by 1/hws, this doesn't change the fit at
+ * point i but keeps X well-conditioned for large windows.
+ *
+ * \param hws half window size, w = 2 * hws + 1.
+ * \param k order of the polynomial, k < w.
+ * \return coefficient matrix (w x w), the last hws rows are the reversed
+ * first hws rows.
+ */
+SEXP C_coefSG(SEXP hws, SEXP k) {
+    const int h = asInteger(hws), nk = asInteger(k) + 1, w = 2 * h + 1;
+
+    if (h < 0 || nk < 1 || nk > w)
+        error("the window size has to be larger than the polynomial order");
+
+    SEXP out = PROTECT(allocMatrix(REALSXP, w, w));
+    double *f = REAL(out);
+    double *q = (double*) R_alloc((size_t)w * nk, sizeof(double));
+    double *r = (double*) R_alloc((size_t)nk * nk, sizeof(double));
+    double *a = (double*) R_alloc(nk, sizeof(double));
+    const double scale = h > 0 ? 1.0 / h : 1.0;
+
+    for (int i = 0; i <= h; ++i) {
+        /* Vandermonde matrix of the scaled distances to point i */
+        for (int j = 0; j < w; ++j) {
+            const double u = (j - i) * scale;
+            double p = 1;
+            for (int c = 0; c < nk; ++c, p *= u)
+                q[j + c * w] = p;
+        }
+
+        /* QR by modified Gram-Schmidt, each column is orthogonalized twice */
+        for (int c = 0; c < nk; ++c) {
+            double *qc = q + c * w;
+            for (int m = 0; m < c; ++m)
+                r[m + c * nk] = 0;
+            for (int pass = 0; pass < 2; ++pass) {
+                for (int m = 0; m < c; ++m) {
+                    const double *qm = q + m * w;
+                    double d = 0;
+                    for (int j = 0; j < w; ++j)
+                        d += qm[j] * qc[j];
+                    for (int j = 0; j < w; ++j)
+                        qc[j] -= d * qm[j];
+                    r[m + c * nk] += d;
+                }
+            }
+            double norm = 0;
+            for (int j = 0; j < w; ++j)
+                norm += qc[j] * qc[j];
+            norm = sqrt(norm);
+            r[c + c * nk] = norm;
+            for (int j = 0; j < w; ++j)
+                qc[j] /= norm;
+        }
+
+        /* forward substitution R' a = e1 */
+        for (int c = 0; c < nk; ++c) {
+            double s = c == 0 ? 1 : 0;
+            for (int m = 0; m < c; ++m)
+                s -= r[m + c * nk] * a[m];
+            a[c] = s / r[c + c * nk];
+        }
+
+        /* row i = Q a, row w - 1 - i is the reversed row i */
+        for (int j = 0; j < w; ++j) {
+            double s = 0;
+            for (int c = 0; c < nk; ++c)
+                s += q[j + c * w] * a[c];
+            f[i + j * w] = s;
+            if (i < h)
+                f[(w - 1 - i) + (w - 1 - j) * w] = s;
+        }
+    }
+
+    UNPROTECT(1);
+    return out;
+}
+
+/**
+ * Smooth a vector.
+ *
+ * \param x double, values to smooth.
+ * \param cf double, square coefficient matrix with at most length(x) rows,
+ * see coefMA, coefWMA and coefSG.
+ * \return smoothed values.
+ */
+SEXP C_smooth(SEXP x, SEXP cf) {
+    const R_xlen_t n = XLENGTH(x);
+    const smoother s = smoother_of(cf);
+
+    if (s.w > n)
+        error("'cf' has to have at most length(x) rows");
+
+    SEXP out = PROTECT(allocVector(REALSXP, n));
+    smooth_kernel(&s, REAL(x), n, REAL(out));
+
+    UNPROTECT(1);
+    return out;
+}
+
+/**
+ * Smooth the rows or columns of a matrix.
+ *
+ * The rows (columns) are processed in parallel. Rows are copied into a
+ * contiguous buffer (one per thread) before smoothing, columns are smoothed
+ * directly.
+ *
+ * \param x double matrix.
+ * \param cf double, square coefficient matrix, see C_smooth.
+ * \param margin 1: smooth the rows, 2: smooth the columns.
+ * \param nthreads number of threads to use.
+ * \return matrix of the same dimension as x with the smoothed rows (columns).
+ */
+SEXP C_smooth_matrix(SEXP x, SEXP cf, SEXP margin, SEXP nthreads) {
+    const R_xlen_t nr = nrows(x), nc = ncols(x);
+    const int byrow = asInteger(margin) == 1;
+    /* number of vectors, their length and the distance between elements */
+    const R_xlen_t nv = byrow ? nr : nc, n = byrow ? nc : nr;
+    const R_xlen_t stride = byrow ? nr : 1, step = byrow ? 1 : nr;
+    const smoother s = smoother_of(cf);
+
+    if (nv && s.w > n)
+        error("'cf' has to have at most %s rows", byrow ? "ncol(x)" :
+              "nrow(x)");
+
+    SEXP out = PROTECT(allocMatrix(REALSXP, nr, nc));
+    setAttrib(out, R_DimNamesSymbol, getAttrib(x, R_DimNamesSymbol));
+    const double *px = REAL(x);
+    double *pout = REAL(out);
+
+    int nth = asInteger(nthreads);
+#ifdef _OPENMP
+    if (nth < 1 || nv < 2)
+        nth = 1;
+#else
+    nth = 1;
+#endif
+
+    /* per thread buffers for the input and the output of a row */
+    double *buf = byrow ? (double*) R_alloc(2 * nth * n, sizeof(double)) :
+        NULL;
+
+#ifdef _OPENMP
+    #pragma omp parallel for num_threads(nth) schedule(static)
+#endif
+    for (R_xlen_t v = 0; v < nv; ++v) {
+        const double *xv = px + v * step;
+        double *yv = pout + v * step;
+
+        if (byrow) {
+            int t = 0;
+#ifdef _OPENMP
+            t = omp_get_thread_num();
+#endif
+            double *bx = buf + 2 * t * n, *by = bx + n;
+            for (R_xlen_t i = 0; i < n; ++i)
+                bx[i] = xv[i * stride];
+            smooth_kernel(&s, bx, n, by);
+            for (R_xlen_t i = 0; i < n; ++i)
+                yv[i * stride] = by[i];
+        } else
+            smooth_kernel(&s, xv, n, yv);
+    }
+
+    UNPROTECT(1);
+    return out;
+}